@@ -66,8 +66,8 @@ def exemplo_basico():
 
     # Callback para streaming
     def on_chunk(chunk: bytes) -> None:
-        """Callback chamado a cada chunk de texto gerado"""
-        print(chunk.decode("utf-8", errors="ignore"), end="", flush=True)
+        """Callback chamado a cada chunk de texto gerado."""
+        print(chunk.decode("utf-8"), end="", flush=True)
 
     print("\n📝 Gerando texto...\n")
 
@@ -0,0 +1,1724 @@
+#pragma once
+// engine: PolarisEngine sem nenhuma dependencia de Python (reusa common.*).
+// Incluido pelo modulo pybind (polaris_bind.cpp) e pelo servidor nativo
+// (xct-server/polaris_server.cpp).
+#include "arg.h"
+#include "common.h"
+#include "console.h"
+#include "log.h"
+#include "sampling.h"
+#include "llama.h"
+#include "chat.h"
+#include "ggml.h"
+
+#include <cstring>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <algorithm>
+#include <utility>
+#include <cstdlib>   // getenv
+#include <chrono>    // métricas / timer de flush
+#include <cctype>    // tolower
+#include <list>
+#include <deque>
+#include <unordered_map>
+#include <filesystem>
+#include <fstream>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <unistd.h>  // sysconf (RSS), read
+#include <fcntl.h>   // open, posix_fadvise (warmup)
+
+// ================================
+// TRACER: timeline por engine
+// ================================
+// O POLARIS_STAGE para a execucao numa etapa pra diagnostico, mas nao mostra
+// pra onde vai o tempo numa execucao normal. Com o tracer ligado
+// (POLARIS_TRACE=1 ou trace_enable) cada etapa vira um span num ring buffer
+// de tamanho fixo — os mais antigos sao sobrescritos — e trace_dump() grava
+// no formato trace-event do Chrome, que abre direto no Perfetto.
+//
+// Desligado, um span custa um load atomico. Nomes sao sempre literais: o
+// evento guarda so o ponteiro.
+struct Tracer {
+    struct Event {
+        const char * name;
+        int64_t      ts_us;
+        int64_t      dur_us;
+        uint32_t     tid;
+        int64_t      arg;     // tokens / bytes da etapa; -1 = sem
+    };
+
+    std::atomic<bool>  enabled{ false };
+    std::mutex         mtx;
+    std::vector<Event> ring;
+    size_t             head  = 0;   // proxima posicao a escrever
+    size_t             count = 0;
+    const std::chrono::steady_clock::time_point origin = std::chrono::steady_clock::now();
+
+    bool on() const { return enabled.load(std::memory_order_relaxed); }
+
+    int64_t now_us() const {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - origin).count();
+    }
+
+    static uint32_t thread_id() {
+        static std::atomic<uint32_t> next{ 1 };
+        thread_local uint32_t id = next.fetch_add(1);
+        return id;
+    }
+
+    void enable(bool v, size_t capacity) {
+        std::lock_guard<std::mutex> lk(mtx);
+        if (v && ring.size() != capacity) {
+            ring.assign(std::max<size_t>(1, capacity), Event{});
+            head = count = 0;
+        }
+        enabled.store(v);
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lk(mtx);
+        head = count = 0;
+    }
+
+    // Inicio de um span: -1 = tracer desligado nesse momento. Um span que
+    // comecou desligado nunca e gravado, mesmo que o tracer ligue no meio
+    // (senao ele iria do tempo 0 ate agora).
+    int64_t start() const { return on() ? now_us() : -1; }
+
+    void record(const char * name, int64_t t0_us, int64_t t1_us, int64_t arg = -1) {
+        if (!on() || t0_us < 0) return;
+        const uint32_t tid = thread_id();
+        std::lock_guard<std::mutex> lk(mtx);
+        if (ring.empty()) return;
+        ring[head] = Event{ name, t0_us, t1_us - t0_us, tid, arg };
+        head = (head + 1) % ring.size();
+        count = std::min(count + 1, ring.size());
+    }
+
+    std::string to_json() {
+        std::lock_guard<std::mutex> lk(mtx);
+        std::string js = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+        const size_t first = (head + ring.size() - count) % std::max<size_t>(1, ring.size());
+        char line[256];
+        for (size_t k = 0; k < count; ++k) {
+            const Event & e = ring[(first + k) % ring.size()];
+            int n = std::snprintf(line, sizeof(line),
+                                  "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%u,"
+                                  "\"ts\":%lld,\"dur\":%lld",
+                                  k ? "," : "", e.name, (int) getpid(), e.tid,
+                                  (long long) e.ts_us, (long long) e.dur_us);
+            js.append(line, (size_t) n);
+            if (e.arg >= 0) {
+                n = std::snprintf(line, sizeof(line), ",\"args\":{\"n\":%lld}", (long long) e.arg);
+                js.append(line, (size_t) n);
+            }
+            js += '}';
+        }
+        js += "]}";
+        return js;
+    }
+};
+
+// Span RAII: mede do construtor ao destrutor.
+struct TraceSpan {
+    Tracer &     tr;
+    const char * name;
+    int64_t      arg;
+    int64_t      t0;
+    TraceSpan(Tracer & t, const char * n, int64_t a = -1)
+        : tr(t), name(n), arg(a), t0(t.start()) {}
+    ~TraceSpan() { if (t0 >= 0) tr.record(name, t0, tr.now_us(), arg); }
+};
+
+struct PolarisEngine {
+    common_params              params;
+    common_init_result_ptr     init;
+    size_t n_past = 0;
+    llama_model          * model = nullptr;
+    llama_context        * ctx   = nullptr;
+    const llama_vocab    * vocab = nullptr;
+    int safety_margin = 16;
+
+    common_sampler_ptr smpl;
+    common_chat_templates_ptr chat_tmpl;
+
+    std::mutex mtx;
+
+    // ================================
+    // SESSOES: slots de KV nomeados
+    // ================================
+    // O contexto tem UMA seq de KV (seq 0). A sessao dona dela e a
+    // active_session; kv_tokens espelha exatamente o que esta no KV, e e
+    // contra ele que o prompt novo e comparado pra reusar o prefixo.
+    //
+    // Quando outra sessao chega, a ativa e "estacionada": o estado da seq 0
+    // e copiado pra RAM do host (llama_state_seq_get_data) e o KV e limpo.
+    // Na volta dela o estado e restaurado com um memcpy em vez de refazer o
+    // prefill da conversa inteira. As estacionadas vivem num LRU com teto de
+    // RAM (POLARIS_SESSION_MB); estourou, a mais antiga e descartada e so
+    // paga o prefill de novo se voltar.
+    struct ParkedSession {
+        std::vector<uint8_t>             state;   // seq 0 serializada
+        std::vector<llama_token>         tokens;  // conteudo do KV no momento
+        std::string                      adapter; // adapter que gerou esse KV
+        std::list<std::string>::iterator lru_it;
+    };
+
+    struct SessionInfo {
+        std::string name;
+        bool        active;     // true = esta no KV agora
+        size_t      n_tokens;
+        size_t      bytes;      // estado da seq (ativa: calculado na hora)
+    };
+
+    std::string              active_session;
+    std::vector<llama_token> kv_tokens;
+    std::list<std::string>   session_lru;   // frente = uso mais recente
+    std::unordered_map<std::string, ParkedSession> parked;
+    size_t parked_bytes   = 0;
+    size_t session_budget = 0;
+
+    // ================================
+    // ADAPTERS LoRA (troca por pedido)
+    // ================================
+    // Um adapter XCT por dominio de tool, todos carregados UMA vez em cima do
+    // mesmo modelo base — em vez de um GGUF mergeado e um Engine inteiro
+    // (pesos + load) por dominio. Cada pedido escolhe o adapter (e a escala);
+    // a troca no contexto so acontece quando muda em relacao ao anterior.
+    //
+    // O KV depende do adapter: o mesmo prefixo de tokens calculado com outro
+    // adapter NAO e o mesmo prefixo. kv_adapter guarda a chave (nome@escala)
+    // que produziu o KV atual; chave diferente = KV descartado.
+    struct AdapterInfo {
+        std::string name;
+        std::string path;
+        size_t      file_bytes      = 0;   // tamanho do ARQUIVO GGUF (nao dos tensores carregados)
+        bool        active          = false; // aplicado agora (preenchido em adapter_list)
+        size_t      switches        = 0;   // trocas PARA este adapter
+        double      switch_ms_last  = 0;
+        double      switch_ms_total = 0;
+    };
+    std::vector<AdapterInfo> adapters;        // mesma ordem de params.lora_adapters
+    std::string              active_adapter;  // chave aplicada no contexto ("" = base)
+    int                      active_idx = -1; // indice em adapters do aplicado (-1 = base)
+    std::string              kv_adapter;      // chave que produziu kv_tokens
+
+    // ================================
+    // TABELA DE PIECES (vocab inteiro)
+    // ================================
+    // Montada uma vez no load: o texto de todos os tokens num unico blob
+    // contiguo, com offsets por token — um jogo de offsets com specials
+    // renderizados e outro sem. No loop de decode o piece vira um
+    // string_view pro blob: nada de common_token_to_piece alocando uma
+    // std::string por token.
+    std::string           piece_blob;
+    std::vector<uint32_t> piece_off[2];   // [special] -> n_vocab + 1 offsets
+
+    // Tokens ESPECIAIS de tool-call. No Qwen, <tool_call> e </tool_call> são
+    // tokens ÚNICOS do vocabulário — não strings montadas caractere a
+    // caractere. Detectá-los no momento em que o modelo os emite é o que os
+    // provedores de nuvem fazem: a chamada NUNCA vira texto, então nunca
+    // "vaza" no chat nem depende de regex pra ser reconhecida.
+    // -1 = o modelo não tem esses tokens (aí seguimos no modo texto).
+    llama_token tok_call_start = -1, tok_call_end = -1;
+
+    // ================================
+    // PLANO DE MEMORIA
+    // ================================
+    // Previsto = conta feita com os metadados do GGUF antes de carregar;
+    // real = RSS do processo antes/depois do load. Com mmap o RSS so conta as
+    // paginas de peso ja tocadas, entao o real cresce com o uso.
+    struct MemoryPlan {
+        int         n_ctx = 0;
+        std::string cache_type_k, cache_type_v;
+        bool        flash_attn    = false;
+        size_t      budget_bytes  = 0;   // 0 = sem planner
+        size_t      weights_bytes = 0;   // previsto (parte no host)
+        size_t      kv_bytes      = 0;   // previsto
+        size_t      compute_bytes = 0;   // previsto (estimativa grossa)
+        size_t      rss_before    = 0;   // real
+        size_t      rss_after     = 0;   // real
+        size_t predicted_total() const { return weights_bytes + kv_bytes + compute_bytes; }
+    };
+    MemoryPlan mem_plan;
+    size_t     ram_budget_bytes = 0;
+
+    // ================================
+    // LOAD ASSINCRONO
+    // ================================
+    struct LoadTimings {
+        double plan_ms = 0, init_ms = 0, pieces_ms = 0, touch_ms = 0, warmup_ms = 0, total_ms = 0;
+    };
+    LoadTimings             load_times;
+    bool                    deep_warmup = false;
+    std::thread             loader;
+    std::mutex              load_mtx;
+    std::condition_variable load_cv;
+    bool                    loaded = false;
+    std::exception_ptr      load_error;
+
+    Tracer tracer;
+
+    // ================================
+    // LATENCIA ENTRE TOKENS (ultima chamada)
+    // ================================
+    struct DecodeStats {
+        bool   pipelined   = false;
+        size_t n_tokens    = 0;
+        size_t overrun     = 0;   // decodificados alem do stop e removidos (pipeline)
+        double decode_ms   = 0;
+        double itl_mean_ms = 0, itl_p50_ms = 0, itl_p95_ms = 0, itl_max_ms = 0;
+    };
+    DecodeStats last_decode;
+
+    static DecodeStats decode_stats_from(std::vector<float> itl, bool pipelined, size_t n_tokens,
+                                         double decode_ms, size_t overrun) {
+        DecodeStats ds;
+        ds.pipelined = pipelined;
+        ds.n_tokens  = n_tokens;
+        ds.overrun   = overrun;
+        ds.decode_ms = decode_ms;
+        if (itl.empty()) return ds;
+        std::sort(itl.begin(), itl.end());
+        double sum = 0;
+        for (float v : itl) sum += v;
+        auto pct = [&](double q) { return (double) itl[std::min(itl.size() - 1, (size_t) (q * (itl.size() - 1) + 0.5))]; };
+        ds.itl_mean_ms = sum / itl.size();
+        ds.itl_p50_ms  = pct(0.50);
+        ds.itl_p95_ms  = pct(0.95);
+        ds.itl_max_ms  = itl.back();
+        return ds;
+    }
+
+    // Pipeline: quantos tokens do fim do KV saem quando o emit mandou parar
+    // no token stop_at (indice entre os gerados; -1 = nao parou). kv_gen0 =
+    // tamanho do KV antes do primeiro gerado. O proprio token do stop sai
+    // tambem: no serial ele nunca entra no KV.
+    static size_t pipeline_overrun(size_t kv_gen0, size_t kv_size, long stop_at) {
+        if (stop_at < 0) return 0;
+        const size_t keep = kv_gen0 + (size_t) stop_at;
+        return kv_size > keep ? kv_size - keep : 0;
+    }
+
+    // helper env
+    static int env_int(const char *k, int defv) {
+        if (const char *v = std::getenv(k)) { try { return std::max(1, std::stoi(v)); } catch (...) {} }
+        return defv;
+    }
+
+    // Como env_int, mas aceita 0 (dial que "desliga" com 0); negativo = defv.
+    static int env_int_or_zero(const char *k, int defv) {
+        if (const char *v = std::getenv(k)) {
+            try { const int n = std::stoi(v); return n >= 0 ? n : defv; } catch (...) {}
+        }
+        return defv;
+    }
+
+    static bool env_bool(const char *k, bool defv) {
+        const char *v = std::getenv(k);
+        if (!v) return defv;
+        std::string s(v);
+        std::transform(s.begin(), s.end(), s.begin(), ::tolower);
+        return s == "1" || s == "true" || s == "yes" || s == "on";
+    }
+
+    static ggml_type cache_type_from_str(const std::string & s) {
+        static const std::pair<const char *, ggml_type> types[] = {
+            { "f32",    GGML_TYPE_F32    }, { "f16",  GGML_TYPE_F16  },
+            { "bf16",   GGML_TYPE_BF16   }, { "q8_0", GGML_TYPE_Q8_0 },
+            { "q4_0",   GGML_TYPE_Q4_0   }, { "q4_1", GGML_TYPE_Q4_1 },
+            { "iq4_nl", GGML_TYPE_IQ4_NL }, { "q5_0", GGML_TYPE_Q5_0 },
+            { "q5_1",   GGML_TYPE_Q5_1   },
+        };
+        for (const auto & t : types) if (s == t.first) return t.second;
+        throw std::invalid_argument("cache_type invalido: " + s);
+    }
+
+    static size_t rss_bytes() {
+        std::ifstream f("/proc/self/statm");
+        size_t pages_total = 0, pages_rss = 0;
+        if (!(f >> pages_total >> pages_rss)) return 0;
+        return pages_rss * (size_t) sysconf(_SC_PAGESIZE);
+    }
+
+    // Formato do modelo que importa pra conta de memoria, lido dos metadados.
+    struct ModelShape {
+        int64_t n_layer = 0, n_embd = 0, n_head = 1, n_head_kv = 1;
+        int64_t head_k = 0, head_v = 0, n_ctx_train = 0, n_vocab = 0;
+        size_t  file_bytes = 0;
+    };
+
+    static ModelShape model_shape(const llama_model * m, const std::string & path) {
+        ModelShape sh;
+        auto meta_int = [&](const std::string & key, int64_t defv) -> int64_t {
+            char buf[64];
+            if (llama_model_meta_val_str(m, key.c_str(), buf, sizeof(buf)) < 0) return defv;
+            try { return std::stoll(buf); } catch (...) { return defv; }
+        };
+        char arch[64] = { 0 };
+        llama_model_meta_val_str(m, "general.architecture", arch, sizeof(arch));
+
+        sh.n_layer     = llama_model_n_layer(m);
+        sh.n_embd      = llama_model_n_embd(m);
+        sh.n_head      = std::max(1, llama_model_n_head(m));
+        sh.n_head_kv   = std::max(1, llama_model_n_head_kv(m));
+        sh.n_ctx_train = llama_model_n_ctx_train(m);
+        sh.n_vocab     = llama_vocab_n_tokens(llama_model_get_vocab(m));
+        sh.head_k = meta_int(std::string(arch) + ".attention.key_length",   sh.n_embd / sh.n_head);
+        sh.head_v = meta_int(std::string(arch) + ".attention.value_length", sh.n_embd / sh.n_head);
+
+        std::error_code ec;
+        sh.file_bytes = (size_t) std::filesystem::file_size(path, ec);
+        if (ec) sh.file_bytes = 0;
+        return sh;
+    }
+
+    // Camadas que vao MESMO pra GPU. Build sem offload (build-cpu) ignora
+    // n_gpu_layers e deixa tudo na RAM; negativo = todas; o resto e aparado
+    // no numero de camadas do modelo.
+    static int64_t layers_on_gpu(int n_gpu_layers, int64_t n_layer) {
+        if (!llama_supports_gpu_offload()) return 0;
+        if (n_gpu_layers < 0) return n_layer;
+        return std::min<int64_t>(n_gpu_layers, n_layer);
+    }
+
+    // Fracao dos pesos que fica no host (1.0 = tudo na RAM).
+    double host_weight_frac(int64_t n_layer) const {
+        if (n_layer <= 0) return 1.0;
+        return (double) (n_layer - layers_on_gpu(params.n_gpu_layers, n_layer)) / (double) n_layer;
+    }
+
+    // Previsao de RAM do host pra um n_ctx / tipo de cache. Pesos = arquivo
+    // menos a fatia de camadas na GPU; KV idem, a menos de no_kv_offload.
+    // O compute e estimativa grossa: ativacoes de um ubatch mais os scores de
+    // atencao, que sem flash attn sao n_ubatch x n_ctx x n_head em f32.
+    void predict_memory(const ModelShape & sh, int64_t nc, ggml_type tk, ggml_type tv,
+                        bool fa, MemoryPlan & mp) const {
+        const double  host_frac = host_weight_frac(sh.n_layer);
+        const double  kv_frac   = params.no_kv_offload ? 1.0 : host_frac;
+        const int64_t n_ub      = params.n_ubatch;
+
+        const size_t per_tok = (size_t) (sh.n_layer * sh.n_head_kv) *
+                               (ggml_row_size(tk, sh.head_k) + ggml_row_size(tv, sh.head_v));
+        mp.weights_bytes = (size_t) ((double) sh.file_bytes * host_frac);
+        mp.kv_bytes      = (size_t) ((double) (per_tok * (size_t) nc) * kv_frac);
+        mp.compute_bytes = (size_t) (n_ub * (sh.n_vocab + 8 * sh.n_embd) * 4);
+        if (!fa) mp.compute_bytes += (size_t) (n_ub * nc * sh.n_head * 4);
+    }
+
+    // Le os metadados do GGUF (vocab_only: sem tensores) e escolhe o maior
+    // n_ctx / tipo de cache que cabe no orcamento. O tipo pedido e o teto de
+    // precisao: o planner so desce a escada (pedido -> q8_0 -> q4_0), nunca
+    // sobe. Prefere manter o n_ctx pedido com mais precisao; se nenhum tipo
+    // chega la, fica com o que rende o maior n_ctx. Sem flash attn (v_quant
+    // false) so o K desce: V quantizado nao existe sem ela.
+    void plan_memory(size_t budget, bool fa, bool v_quant) {
+        llama_model_params mparams = llama_model_default_params();
+        mparams.vocab_only = true;
+        llama_model * meta = llama_model_load_from_file(params.model.path.c_str(), mparams);
+        if (!meta)
+            throw std::runtime_error("planner: falha ao ler metadados de " + params.model.path);
+        const ModelShape sh = model_shape(meta, params.model.path);
+        llama_model_free(meta);
+
+        std::vector<std::pair<ggml_type, ggml_type>> ladder{ { params.cache_type_k, params.cache_type_v } };
+        for (ggml_type t : { GGML_TYPE_Q8_0, GGML_TYPE_Q4_0 })
+            if (ggml_row_size(t, sh.head_k) < ggml_row_size(ladder.back().first, sh.head_k))
+                ladder.push_back({ t, v_quant ? t : params.cache_type_v });
+
+        const int64_t MIN_CTX = 256;
+        int64_t want = params.n_ctx > 0 ? params.n_ctx : sh.n_ctx_train;
+        if (sh.n_ctx_train > 0) want = std::min(want, sh.n_ctx_train);
+        // multiplo de MIN_CTX; abaixo dele sobe pro minimo em vez de virar 0
+        want = std::max(MIN_CTX, want - want % MIN_CTX);
+
+        MemoryPlan best;
+        for (const auto & kv : ladder) {
+            // maior n_ctx (multiplo de 256) que cabe com este tipo
+            MemoryPlan cand;
+            int64_t nc = want;
+            for (; nc >= MIN_CTX; nc -= MIN_CTX) {
+                predict_memory(sh, nc, kv.first, kv.second, fa, cand);
+                if (cand.predicted_total() <= budget) break;
+            }
+            if (nc > best.n_ctx) {
+                best = cand;
+                best.n_ctx = (int) nc;
+                params.cache_type_k = kv.first;
+                params.cache_type_v = kv.second;
+            }
+            if (nc >= want) break;
+        }
+        if (best.n_ctx < MIN_CTX) {
+            predict_memory(sh, MIN_CTX, ladder.back().first, ladder.back().second, fa, best);
+            throw std::runtime_error("planner: modelo nao cabe em " + std::to_string(budget >> 20) +
+                                     " MB (minimo previsto ~" + std::to_string(best.predicted_total() >> 20) + " MB)");
+        }
+
+        params.n_ctx          = best.n_ctx;
+        mem_plan.n_ctx         = best.n_ctx;
+        mem_plan.budget_bytes  = budget;
+        mem_plan.weights_bytes = best.weights_bytes;
+        mem_plan.kv_bytes      = best.kv_bytes;
+        mem_plan.compute_bytes = best.compute_bytes;
+
+        LOG_INF("planner: orcamento %zu MB -> n_ctx=%d K=%s V=%s | previsto %zu MB "
+                "(pesos %zu + kv %zu + compute %zu)\n",
+                budget >> 20, best.n_ctx, ggml_type_name(params.cache_type_k),
+                ggml_type_name(params.cache_type_v), mem_plan.predicted_total() >> 20,
+                mem_plan.weights_bytes >> 20, mem_plan.kv_bytes >> 20, mem_plan.compute_bytes >> 20);
+    }
+
+    PolarisEngine(const std::string & model_path,
+                int n_ctx = 4096,
+                int n_threads = 0,
+                int n_gpu_layers = -1,
+                const std::string & cache_type_k = "f16",
+                const std::string & cache_type_v = "f16",
+                const std::string & flash_attn = "auto",
+                bool use_mmap = true,
+                bool use_mlock = false,
+                bool no_kv_offload = false,
+                int ram_budget_mb = 0,
+                bool async_load = false,
+                bool warmup = false,
+                const std::vector<std::pair<std::string, std::string>> & lora_adapters = {}) {
+
+        params = common_params{};
+        params.model.path = model_path;
+
+        if (n_ctx > 0) params.n_ctx = n_ctx;
+
+        if (n_threads > 0) {
+            params.cpuparams.n_threads       = n_threads;
+            params.cpuparams_batch.n_threads = n_threads;
+        }
+
+        // ================================
+        // XCT MODE: COMPLETADOR CRU
+        // ================================
+        params.conversation_mode     = COMMON_CONVERSATION_MODE_DISABLED;
+        params.enable_chat_template  = false;
+        params.use_jinja             = false;
+        params.chat_template         = "";
+
+        // GPU layers
+        if (n_gpu_layers == -1) {
+            const char *env_val = std::getenv("POLARIS_N_GPU_LAYERS");
+            if (env_val) {
+                try { params.n_gpu_layers = std::stoi(env_val); }
+                catch (...) { params.n_gpu_layers = 999; }
+            } else {
+                params.n_gpu_layers = 999;
+            }
+        } else {
+            params.n_gpu_layers = n_gpu_layers;
+        }
+
+        // batch & ubatch
+        params.n_batch  = env_int("POLARIS_BATCH", 256);
+        params.n_ubatch = env_int("POLARIS_UBATCH", 128);
+        params.special  = env_bool("POLARIS_SPECIAL", true);
+        safety_margin   = env_int("POLARIS_SAFETY", 16);
+        session_budget  = (size_t) env_int_or_zero("POLARIS_SESSION_MB", 2048) * 1024 * 1024;
+
+        // ================================
+        // MEMORIA: cache de KV, flash attn, mmap/mlock
+        // ================================
+        // Os defaults do llama.cpp (KV em f16) num host so de CPU fazem um 8B
+        // com 8k de contexto ocupar bem mais RAM que o necessario. q8_0 corta
+        // o KV pela metade com perda desprezivel; q4_0 pela metade de novo.
+        params.cache_type_k  = cache_type_from_str(cache_type_k);
+        params.cache_type_v  = cache_type_from_str(cache_type_v);
+        params.use_mmap      = use_mmap;
+        params.use_mlock     = use_mlock;
+        params.no_kv_offload = no_kv_offload;
+
+        if (flash_attn == "on")       params.flash_attn_type = LLAMA_FLASH_ATTN_TYPE_ENABLED;
+        else if (flash_attn == "off") params.flash_attn_type = LLAMA_FLASH_ATTN_TYPE_DISABLED;
+        else if (flash_attn == "auto") params.flash_attn_type = LLAMA_FLASH_ATTN_TYPE_AUTO;
+        else throw std::invalid_argument("flash_attn deve ser auto/on/off: " + flash_attn);
+        ram_budget_bytes = (size_t) std::max(0, ram_budget_mb) * 1024 * 1024;
+        deep_warmup      = warmup;
+
+        if (env_bool("POLARIS_TRACE", false))
+            tracer.enable(true, (size_t) env_int("POLARIS_TRACE_EVENTS", 65536));
+        // o nosso warmup substitui o do llama.cpp (que so roda 1 token)
+        if (deep_warmup) params.warmup = false;
+
+        // adapters: carregados pelo common_init com escala 0 (nao aplicados);
+        // quem aplica e o pedido, via apply_adapter
+        for (const auto & nl : lora_adapters) {
+            for (const auto & a : adapters)
+                if (a.name == nl.first) throw std::invalid_argument("adapter repetido: " + nl.first);
+            common_adapter_lora_info la;
+            la.path  = nl.second;
+            la.scale = 0.0f;
+            params.lora_adapters.push_back(la);
+
+            AdapterInfo ai;
+            ai.name = nl.first;
+            ai.path = nl.second;
+            std::error_code ec;
+            ai.file_bytes = (size_t) std::filesystem::file_size(nl.second, ec);
+            if (ec) ai.file_bytes = 0;
+            adapters.push_back(ai);
+        }
+        params.lora_init_without_apply = true;
+
+        // ================================
+        // LOAD: sincrono ou numa thread nativa
+        // ================================
+        // Com async_load o construtor volta na hora e o Python acompanha por
+        // ready()/wait(); o worker so entra no balanceador quando estiver
+        // quente de verdade. Qualquer chamada que precise do modelo espera o
+        // load terminar (ensure_ready).
+        if (async_load) {
+            loader = std::thread([this] { run_load(); });
+        } else {
+            run_load();
+            if (load_error) std::rethrow_exception(load_error);
+        }
+    }
+
+    ~PolarisEngine() {
+        // nao da pra interromper common_init_from_params: espera ele acabar
+        if (loader.joinable()) loader.join();
+    }
+
+    void run_load() {
+        auto t0 = std::chrono::steady_clock::now();
+        auto ms_since = [](std::chrono::steady_clock::time_point a) {
+            return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - a).count();
+        };
+        try {
+            if (ram_budget_bytes > 0) {
+                auto tp = std::chrono::steady_clock::now();
+                // "auto" conta como sem flash attn: a previsao fica do lado seguro
+                plan_memory(ram_budget_bytes,
+                            params.flash_attn_type == LLAMA_FLASH_ATTN_TYPE_ENABLED,
+                            params.flash_attn_type != LLAMA_FLASH_ATTN_TYPE_DISABLED);
+                load_times.plan_ms = ms_since(tp);
+            }
+
+            // V quantizado so existe com flash attention no llama.cpp
+            if (ggml_is_quantized(params.cache_type_v)) {
+                if (params.flash_attn_type == LLAMA_FLASH_ATTN_TYPE_DISABLED)
+                    throw std::invalid_argument("cache_type_v quantizado exige flash_attn");
+                params.flash_attn_type = LLAMA_FLASH_ATTN_TYPE_ENABLED;
+            }
+
+            mem_plan.cache_type_k = ggml_type_name(params.cache_type_k);
+            mem_plan.cache_type_v = ggml_type_name(params.cache_type_v);
+            mem_plan.flash_attn   = params.flash_attn_type == LLAMA_FLASH_ATTN_TYPE_ENABLED;
+
+            // init llama.cpp backend
+            auto ti = std::chrono::steady_clock::now();
+            common_init();
+            mem_plan.rss_before = rss_bytes();
+            init  = common_init_from_params(params);
+
+            model = init->model();
+            ctx   = init->context();
+
+            if (!model || !ctx)
+                throw std::runtime_error("Falha ao carregar modelo/contexto");
+            load_times.init_ms = ms_since(ti);
+
+            vocab = llama_model_get_vocab(model);
+            auto tpc = std::chrono::steady_clock::now();
+            build_piece_table();
+            load_times.pieces_ms = ms_since(tpc);
+
+            for (size_t i = 0; i < adapters.size(); ++i) {
+                if (!params.lora_adapters[i].ptr)
+                    throw std::runtime_error("Falha ao carregar adapter " + adapters[i].path);
+                LOG_INF("lora: '%s' carregado (arquivo %zu MB)\n", adapters[i].name.c_str(), adapters[i].file_bytes >> 20);
+            }
+
+            // ================================
+            // NUNCA inicializa chat templates
+            // ================================
+            chat_tmpl = nullptr;
+
+            // sampler normal
+            smpl.reset(common_sampler_init(model, params.sampling));
+            if (!smpl)
+                throw std::runtime_error("Falha ao inicializar sampler");
+
+            if (deep_warmup) run_warmup();
+
+            mem_plan.n_ctx     = (int) llama_n_ctx(ctx);
+            mem_plan.rss_after = rss_bytes();
+            if (mem_plan.budget_bytes == 0) {
+                // sem planner: a previsao sai do modelo ja carregado, so pra relatorio
+                predict_memory(model_shape(model, params.model.path), mem_plan.n_ctx,
+                               params.cache_type_k, params.cache_type_v, mem_plan.flash_attn, mem_plan);
+            }
+            LOG_INF("memoria: n_ctx=%d K=%s V=%s fa=%d | previsto %zu MB | RSS real +%zu MB (total %zu MB)\n",
+                    mem_plan.n_ctx, mem_plan.cache_type_k.c_str(), mem_plan.cache_type_v.c_str(),
+                    (int) mem_plan.flash_attn, mem_plan.predicted_total() >> 20,
+                    (mem_plan.rss_after - std::min(mem_plan.rss_before, mem_plan.rss_after)) >> 20,
+                    mem_plan.rss_after >> 20);
+        } catch (...) {
+            load_error = std::current_exception();
+        }
+
+        load_times.total_ms = ms_since(t0);
+        LOG_INF("load: %.0fms (plan %.0f | init %.0f | pieces %.0f | touch %.0f | warmup %.0f)%s\n",
+                load_times.total_ms, load_times.plan_ms, load_times.init_ms, load_times.pieces_ms,
+                load_times.touch_ms, load_times.warmup_ms, load_error ? " FALHOU" : "");
+        {
+            std::lock_guard<std::mutex> lk(load_mtx);
+            loaded = true;
+        }
+        load_cv.notify_all();
+    }
+
+    // Warmup de verdade, no lugar do de 1 token do llama.cpp:
+    //  1) le o GGUF inteiro em sequencia, pra que as paginas de peso ja
+    //     estejam no page cache (com mmap, o primeiro request nao paga I/O
+    //     de disco em fault). Com todas as camadas na GPU as paginas do
+    //     host nao sao mais usadas depois do load: a leitura e pulada;
+    //  2) um decode dummy com o formato REAL de batch (um ubatch cheio de
+    //     prefill e depois 1 token de decode) — passa por todas as camadas,
+    //     tocando os pesos mapeados e alocando os grafos dos dois formatos.
+    void run_warmup() {
+        auto t0 = std::chrono::steady_clock::now();
+        if (params.use_mmap && !params.use_mlock && host_weight_frac(llama_model_n_layer(model)) > 0.0) {
+            const int fd = ::open(params.model.path.c_str(), O_RDONLY);
+            if (fd >= 0) {
+                posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+                std::vector<char> chunk((size_t) 8 << 20);
+                while (::read(fd, chunk.data(), chunk.size()) > 0) {}
+                ::close(fd);
+            }
+        }
+        auto t1 = std::chrono::steady_clock::now();
+        load_times.touch_ms = std::chrono::duration<double, std::milli>(t1 - t0).count();
+
+        const int n_ub = std::max(1, std::min<int>(params.n_ubatch, (int) llama_n_ctx(ctx) - safety_margin - 1));
+        llama_token tok = llama_vocab_bos(vocab);
+        if (tok < 0) tok = 0;
+
+        llama_batch batch = llama_batch_init(n_ub, 0, 1);
+        auto run = [&](int n, int pos0) {
+            batch.n_tokens = n;
+            for (int k = 0; k < n; ++k) {
+                batch.token[k]     = tok;
+                batch.pos[k]       = pos0 + k;
+                batch.logits[k]    = (k == n - 1);
+                batch.n_seq_id[k]  = 1;
+                batch.seq_id[k][0] = 0;
+            }
+            if (llama_decode(ctx, batch) != 0)
+                LOG_WRN("warmup: llama_decode falhou (n=%d)\n", n);
+        };
+        run(n_ub, 0);
+        run(1, n_ub);
+        llama_batch_free(batch);
+        llama_synchronize(ctx);
+
+        kv_clear();
+        llama_perf_context_reset(ctx);
+        load_times.warmup_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t1).count();
+    }
+
+    bool ready() {
+        std::lock_guard<std::mutex> lk(load_mtx);
+        return loaded && !load_error;
+    }
+
+    // Espera o load; timeout < 0 = sem limite. false = ainda carregando.
+    // Se o load falhou, relanca o erro dele.
+    bool wait(double timeout_s) {
+        std::unique_lock<std::mutex> lk(load_mtx);
+        if (timeout_s < 0) {
+            load_cv.wait(lk, [this] { return loaded; });
+        } else if (!load_cv.wait_for(lk, std::chrono::duration<double>(timeout_s), [this] { return loaded; })) {
+            return false;
+        }
+        if (load_error) std::rethrow_exception(load_error);
+        return true;
+    }
+
+    void ensure_ready() { wait(-1.0); }
+
+    // Espera o load terminar SEM relancar o erro: os tempos das fases que
+    // rodaram sao justamente o que se quer ver num load que falhou.
+    // Devolve a mensagem do erro ("" = ok).
+    std::string wait_loaded_noexcept() {
+        std::unique_lock<std::mutex> lk(load_mtx);
+        load_cv.wait(lk, [this] { return loaded; });
+        if (!load_error) return "";
+        try {
+            std::rethrow_exception(load_error);
+        } catch (const std::exception & e) {
+            return e.what();
+        } catch (...) {
+            return "erro desconhecido";
+        }
+    }
+
+    void trace_dump(const std::string & path) {
+        const std::string js = tracer.to_json();
+        std::ofstream f(path, std::ios::binary);
+        if (!f) throw std::runtime_error("trace_dump: nao abriu " + path);
+        f.write(js.data(), (std::streamsize) js.size());
+    }
+
+    void build_piece_table() {
+        auto t0 = std::chrono::steady_clock::now();
+        const int n_vocab = llama_vocab_n_tokens(vocab);
+
+        piece_blob.clear();
+        piece_blob.reserve((size_t) n_vocab * 16);
+        std::vector<char> tmp(256);
+        for (int sp = 0; sp < 2; ++sp) {
+            auto & off = piece_off[sp];
+            off.resize((size_t) n_vocab + 1);
+            for (llama_token i = 0; i < n_vocab; ++i) {
+                off[i] = (uint32_t) piece_blob.size();
+                int n = llama_token_to_piece(vocab, i, tmp.data(), (int32_t) tmp.size(), 0, sp == 1);
+                if (n < 0) {
+                    tmp.resize((size_t) -n);
+                    n = llama_token_to_piece(vocab, i, tmp.data(), (int32_t) tmp.size(), 0, sp == 1);
+                }
+                if (n > 0) piece_blob.append(tmp.data(), (size_t) n);
+            }
+            off[n_vocab] = (uint32_t) piece_blob.size();
+        }
+        piece_blob.shrink_to_fit();
+
+        for (llama_token i = 0; i < n_vocab; i++) {
+            const char * tp = llama_vocab_get_text(vocab, i);
+            if (!tp) continue;
+            if (tok_call_start < 0 && std::strcmp(tp, "<tool_call>") == 0)  tok_call_start = i;
+            if (tok_call_end   < 0 && std::strcmp(tp, "</tool_call>") == 0) tok_call_end   = i;
+            if (tok_call_start >= 0 && tok_call_end >= 0) break;
+        }
+
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+        LOG_INF("pieces: %d tokens, %zu bytes em %.1fms\n", n_vocab, piece_blob.size(), ms);
+    }
+
+    std::string_view piece_of(llama_token id, bool special) const {
+        const auto & off = piece_off[special ? 1 : 0];
+        if (id < 0 || (size_t) id + 1 >= off.size()) return {};
+        return std::string_view(piece_blob.data() + off[id], off[id + 1] - off[id]);
+    }
+
+    // Quantos bytes do inicio de s terminam num code point UTF-8 completo.
+    // Um token BPE pode carregar so parte de um caractere multi-byte (o resto
+    // vem no token seguinte); o flush entrega ate aqui e segura a cauda, pra
+    // que todo chunk do stream seja UTF-8 valido por si so. Sequencia
+    // invalida nao e segurada: vai do jeito que veio, nada se perde.
+    static size_t utf8_complete_len(const std::string & s) {
+        const size_t n = s.size();
+        for (size_t back = 1; back <= 4 && back <= n; ++back) {
+            const unsigned char c = (unsigned char) s[n - back];
+            if ((c & 0xC0) == 0x80) continue;       // byte de continuacao
+            size_t need = 1;
+            if      ((c & 0xE0) == 0xC0) need = 2;
+            else if ((c & 0xF0) == 0xE0) need = 3;
+            else if ((c & 0xF8) == 0xF0) need = 4;
+            return back < need ? n - back : n;
+        }
+        return n;
+    }
+
+    // Chave do adapter no KV: o mesmo adapter com outra escala tambem e
+    // outro prefixo.
+    static std::string adapter_key(const std::string & name, double scale) {
+        if (name.empty() || scale == 0.0) return "";
+        char buf[32];
+        std::snprintf(buf, sizeof(buf), "@%g", scale);
+        return name + buf;
+    }
+
+    // Aplica o adapter pedido no contexto ("" = so o modelo base). Nao mexe
+    // no KV; quem decide se ele ainda vale e o generate_chat (kv_adapter).
+    void apply_adapter(const std::string & name, double scale) {
+        const std::string key = adapter_key(name, scale);
+        if (key == active_adapter) return;
+
+        // procura antes de mexer: nome desconhecido nao pode deixar params
+        // fora de sincronia com o que esta aplicado no ctx
+        AdapterInfo * target = nullptr;
+        if (!name.empty()) {
+            for (auto & ai : adapters)
+                if (ai.name == name) { target = &ai; break; }
+            if (!target) throw std::invalid_argument("adapter desconhecido: " + name);
+        }
+        for (size_t i = 0; i < adapters.size(); ++i)
+            params.lora_adapters[i].scale = &adapters[i] == target ? (float) scale : 0.0f;
+
+        TraceSpan span(tracer, "adapter_switch");
+        auto t0 = std::chrono::steady_clock::now();
+        common_set_adapter_lora(ctx, params.lora_adapters);
+        const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+
+        if (target) {
+            target->switches++;
+            target->switch_ms_last   = ms;
+            target->switch_ms_total += ms;
+        }
+        LOG_INF("lora: '%s' -> '%s' em %.3fms\n", active_adapter.c_str(), key.c_str(), ms);
+        active_adapter = key;
+        active_idx     = target && scale != 0.0 ? (int) (target - adapters.data()) : -1;
+    }
+
+    // ---- sessoes: estacionar / restaurar / despejar ----
+    void kv_clear() {
+        llama_memory_clear(llama_get_memory(ctx), /*keep_meta=*/false);
+        kv_tokens.clear();
+        n_past = 0;
+    }
+
+    void drop_parked(const std::string & name) {
+        auto it = parked.find(name);
+        if (it == parked.end()) return;
+        parked_bytes -= it->second.state.size();
+        session_lru.erase(it->second.lru_it);
+        parked.erase(it);
+    }
+
+    // Descarta as menos usadas ate caber no teto de RAM.
+    void evict_to_budget() {
+        while (parked_bytes > session_budget && !session_lru.empty()) {
+            const std::string victim = session_lru.back();
+            LOG_INF("session: despejando '%s' (%zu bytes) por teto de RAM\n",
+                    victim.c_str(), parked.at(victim).state.size());
+            drop_parked(victim);
+        }
+    }
+
+    // Copia a seq 0 da sessao ativa pra RAM do host. Nao limpa o KV.
+    void park_active() {
+        if (active_session.empty() || kv_tokens.empty()) return;
+        if (session_budget == 0) {
+            // POLARIS_SESSION_MB=0: sem RAM pra sessao ociosa; nem serializa
+            drop_parked(active_session);
+            return;
+        }
+
+        TraceSpan span(tracer, "session_park", (int64_t) kv_tokens.size());
+        auto t0 = std::chrono::steady_clock::now();
+        drop_parked(active_session);
+
+        ParkedSession ps;
+        const size_t sz = llama_state_seq_get_size(ctx, 0);
+        ps.state.resize(sz);
+        const size_t wrote = llama_state_seq_get_data(ctx, ps.state.data(), sz, 0);
+        if (wrote == 0) {
+            LOG_WRN("session: falha ao serializar '%s'; proxima volta refaz o prefill\n",
+                    active_session.c_str());
+            return;
+        }
+        ps.state.resize(wrote);
+        ps.tokens  = kv_tokens;
+        ps.adapter = kv_adapter;
+
+        session_lru.push_front(active_session);
+        ps.lru_it = session_lru.begin();
+        parked_bytes += ps.state.size();
+        parked.emplace(active_session, std::move(ps));
+
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+        LOG_INF("session: '%s' estacionada (%zu toks, %zu bytes) em %.2fms\n",
+                active_session.c_str(), kv_tokens.size(), wrote, ms);
+        evict_to_budget();
+    }
+
+    // Devolve a sessao ao KV (que deve estar limpo). false = nao estava no LRU.
+    bool restore_session(const std::string & name) {
+        auto it = parked.find(name);
+        if (it == parked.end()) return false;
+
+        TraceSpan span(tracer, "session_restore", (int64_t) it->second.tokens.size());
+        auto t0 = std::chrono::steady_clock::now();
+        ParkedSession & ps = it->second;
+        const size_t read = llama_state_seq_set_data(ctx, ps.state.data(), ps.state.size(), 0);
+        if (read == 0) {
+            LOG_WRN("session: falha ao restaurar '%s'; refazendo o prefill\n", name.c_str());
+            drop_parked(name);
+            kv_clear();
+            return false;
+        }
+        kv_tokens  = std::move(ps.tokens);
+        kv_adapter = ps.adapter;
+        n_past    = kv_tokens.size();
+        drop_parked(name);
+
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+        LOG_INF("session: '%s' restaurada (%zu toks) em %.2fms\n", name.c_str(), n_past, ms);
+        return true;
+    }
+
+    // Coloca a sessao pedida na seq 0. "" = chamada anonima (sem slot).
+    void select_session(const std::string & name) {
+        if (name == active_session) return;
+        park_active();
+        kv_clear();
+        active_session = name;
+        if (!name.empty()) restore_session(name);
+    }
+
+    std::vector<SessionInfo> sessions() {
+        ensure_ready();
+        std::lock_guard<std::mutex> lock(mtx);
+        std::vector<SessionInfo> outv;
+        if (!active_session.empty())
+            outv.push_back({ active_session, true, kv_tokens.size(),
+                             kv_tokens.empty() ? 0 : llama_state_seq_get_size(ctx, 0) });
+        for (const auto & name : session_lru) {
+            const ParkedSession & ps = parked.at(name);
+            outv.push_back({ name, false, ps.tokens.size(), ps.state.size() });
+        }
+        return outv;
+    }
+
+    DecodeStats decode_stats() {
+        std::lock_guard<std::mutex> lock(mtx);
+        return last_decode;
+    }
+
+    std::vector<AdapterInfo> adapter_list() {
+        ensure_ready();
+        std::lock_guard<std::mutex> lock(mtx);
+        std::vector<AdapterInfo> out = adapters;
+        for (size_t i = 0; i < out.size(); ++i) out[i].active = (int) i == active_idx;
+        return out;
+    }
+
+    void drop_session(const std::string & name) {
+        ensure_ready();
+        std::lock_guard<std::mutex> lock(mtx);
+        if (!name.empty() && name == active_session) {
+            kv_clear();
+            active_session.clear();
+        }
+        drop_parked(name);
+    }
+
+    struct SamplerCfg { float temp, top_p, rep, topk, minp, freq, pres; int seed; std::string grammar; };
+    SamplerCfg last_cfg{ -1.f, -1.f, -1.f, -1.f, -1.f, -1.f, -1.f, -1 };
+
+    // generate: a forma antiga (system + um unico user). Mantida porque e assim
+    // que metade das chamadas ja existe. Por baixo delega pro caminho novo.
+    // ChatMsg: uma mensagem com o papel preservado. E um std::pair de proposito:
+    // pybind11/stl.h converte tupla/lista do Python direto, sem registrar tipo.
+    using ChatMsg = std::pair<std::string, std::string>;  // (role, content)
+
+    // ChunkFn: recebe cada pedaco do stream (sempre em code point UTF-8
+    // completo; uma cauda que o fim da geracao deixou partida chega como
+    // U+FFFD). O ponteiro aponta pro buffer interno e so vale durante a
+    // chamada — quem precisa guardar, copia; quem so escreve num socket, nao.
+    // Retornar false cancela a geracao (cliente sumiu, etc).
+    using ChunkFn = std::function<bool(const char * data, size_t n)>;
+
+    std::string generate(const std::string & prompt,
+                         const std::string & system_prompt,
+                         int n_predict,
+                         double temperature,
+                         double top_p,
+                         double repeat_penalty,
+                         int    top_k,
+                         double min_p,
+                         double penalty_freq,
+                         double penalty_present,
+                         int    seed,
+                         const std::string & grammar,
+                         const ChunkFn & on_chunk) {
+        std::vector<ChatMsg> msgs;
+        if (!system_prompt.empty()) msgs.emplace_back("system", system_prompt);
+        msgs.emplace_back("user", prompt);
+        return generate_chat(msgs, n_predict, temperature, top_p, repeat_penalty,
+                             top_k, min_p, penalty_freq, penalty_present, seed,
+                             grammar, on_chunk, "", "", 1.0);
+    }
+
+    // generate_chat: a conversa com os PAPEIS preservados.
+    //
+    // Por que existe: antes o historico inteiro — os turnos anteriores, as
+    // chamadas que o proprio modelo fez, os resultados que voltaram — era
+    // concatenado DENTRO de um unico <|im_start|>user. O modelo nao tinha como
+    // saber que ELE havia feito aquelas chamadas: pra ele o usuario escreveu um
+    // texto gigante que por acaso continha tool_calls. Consequencia medida em
+    // 20-21/07: ele nao percebia que ja tinha investigado e seguia pedindo tool
+    // pra sempre, e a regra do system afundava a tres turnos de distancia
+    // dentro do mesmo bloco. Um bloco ChatML por mensagem devolve o turno.
+    //
+    // session: nome do slot de KV da conversa. Com sessao, o KV da chamada
+    // anterior dela e reaproveitado ate onde o prompt novo coincide, e ela
+    // e estacionada na RAM quando outra sessao pega o contexto.
+    //
+    // adapter / adapter_scale: adapter LoRA (pelo nome dado no construtor)
+    // aplicado SO neste pedido. "" = modelo base.
+    std::string generate_chat(const std::vector<ChatMsg> & messages,
+                              int n_predict,
+                              double temperature,
+                              double top_p,
+                              double repeat_penalty,
+                              int    top_k,
+                              double min_p,
+                              double penalty_freq,
+                              double penalty_present,
+                              int    seed,
+                              const std::string & grammar,
+                              const ChunkFn & on_chunk,
+                              const std::string & session,
+                              const std::string & adapter,
+                              double adapter_scale) {
+        ensure_ready();
+        std::lock_guard<std::mutex> lock(mtx);
+        TraceSpan span_call(tracer, "generate_chat");
+
+        // --- helpers ENV / flags de diagnóstico ---
+        auto getenv_str = [](const char* k) -> std::string {
+            const char* v = std::getenv(k);
+            return v ? std::string(v) : std::string();
+        };
+
+        const bool reset_kv = env_bool("POLARIS_RESET_KV", true);
+
+        select_session(session);
+
+        // Chamada anonima segue o comportamento antigo: KV zerado a cada
+        // chamada, a menos que POLARIS_RESET_KV=0 (ai reusa o prefixo).
+        if (session.empty() && reset_kv) {
+            kv_clear();
+        }
+
+        apply_adapter(adapter, adapter_scale);
+        if (active_adapter != kv_adapter) {
+            if (!kv_tokens.empty())
+                LOG_INF("lora: KV calculado com '%s' descartado (pedido usa '%s')\n",
+                        kv_adapter.c_str(), active_adapter.c_str());
+            kv_clear();
+            kv_adapter = active_adapter;
+        }
+
+        const std::string STAGE  = getenv_str("POLARIS_STAGE"); // "", "prompt","tokenize","prefill","sample","piece","push"
+
+        params.n_predict                 = n_predict > 0 ? n_predict : 256;
+        params.sampling.temp             = (float)(temperature     > 0.0  ? temperature     : 0.7);
+        params.sampling.top_p            = (float)(top_p           > 0.0  ? top_p           : 0.9);
+        params.sampling.penalty_repeat   = (float)(repeat_penalty  > 0.0  ? repeat_penalty  : 1.1);
+        params.sampling.top_k            = top_k > 0 ? top_k : 40;
+        params.sampling.min_p            = (float)(min_p           >= 0.0 ? min_p           : 0.05);
+        params.sampling.penalty_freq     = (float)(penalty_freq    >= 0.0 ? penalty_freq    : 0.0);
+        params.sampling.penalty_present  = (float)(penalty_present >= 0.0 ? penalty_present : 0.0);
+        if (seed >= 0) params.sampling.seed = (uint32_t)seed;
+
+        // Grammar (GBNF): quando o cliente manda, o sampler ZERA a probabilidade
+        // de qualquer token que quebre a gramática — o modelo fica IMPEDIDO de
+        // emitir formato inválido, em vez de a gente pedir por favor no prompt e
+        // torcer. É assim que os provedores de nuvem garantem tool-call bem
+        // formado. A Polaris não sabe o que a gramática significa (pode ser
+        // tool-call, JSON, o que for): ela só constrange. Quem conhece as tools
+        // é o cliente (o XCT vive lá).
+        params.sampling.grammar = grammar;
+
+        SamplerCfg cfg{
+            params.sampling.temp,
+            params.sampling.top_p,
+            params.sampling.penalty_repeat,
+            (float)params.sampling.top_k,
+            params.sampling.min_p,
+            params.sampling.penalty_freq,
+            params.sampling.penalty_present,
+            seed,
+            grammar
+        };
+        if (!smpl || cfg.temp != last_cfg.temp || cfg.top_p != last_cfg.top_p ||
+            cfg.rep != last_cfg.rep || cfg.topk != last_cfg.topk ||
+            cfg.minp != last_cfg.minp || cfg.freq != last_cfg.freq ||
+            cfg.pres != last_cfg.pres || cfg.seed != last_cfg.seed ||
+            cfg.grammar != last_cfg.grammar) {
+            smpl.reset(common_sampler_init(model, params.sampling));
+            if (!smpl) throw std::runtime_error("Falha ao (re)configurar sampler");
+            last_cfg = cfg;
+        } else {
+            // Config igual à da chamada anterior: o sampler é REUSADO — e ele
+            // carrega estado. A janela de penalidade (repeat/freq/presence)
+            // guarda os últimos N tokens gerados, e mais abaixo alimentamos o
+            // prompt inteiro com common_sampler_accept(). Sem limpar, a geração
+            // nova começa penalizando tokens do turno ANTERIOR.
+            //
+            // O sintoma é característico: uma resposta boa, a seguinte ruim,
+            // alternando — porque a config só muda de vez em quando e, quando
+            // muda, o sampler é recriado limpo por acaso.
+            common_sampler_reset(smpl.get());
+        }
+
+        // ================================
+        // XCT MODE: ChatML mínimo manual
+        // - sem template apply
+        // - sem jinja
+        // - só trilho pro Qwen
+        // ================================
+
+        std::string prompt_text;
+        int64_t t_render0 = tracer.start();
+
+        // POLARIS_JINJA=1: monta o prompt com o CHAT TEMPLATE do proprio GGUF
+        // (o mesmo caminho do llama-server --jinja), em vez do ChatML na mao.
+        // Provado em 21/07: o mesmo 9B era instavel via ChatML manual e ficou
+        // redondo via template nativo. O fim do prompt (o gatilho do primeiro
+        // token) sai EXATAMENTE como o modelo foi treinado a ver. Dial pra
+        // comparar lado a lado e poder voltar; o manual segue como fallback.
+        const bool use_jinja = env_bool("POLARIS_JINJA", false);
+        if (use_jinja) {
+            static common_chat_templates_ptr tmpls;
+            if (!tmpls) tmpls = common_chat_templates_init(model, "");
+            common_chat_templates_inputs inputs;
+            inputs.add_generation_prompt = true;
+            inputs.use_jinja = true;
+            for (const auto & m : messages) {
+                if (m.second.empty()) continue;
+                std::string role = m.first;
+                if (role != "system" && role != "user" && role != "assistant") role = "user";
+                common_chat_msg msg;
+                msg.role = role;
+                msg.content = m.second;
+                inputs.messages.push_back(msg);
+            }
+            common_chat_params ap = common_chat_templates_apply(tmpls.get(), inputs);
+            prompt_text = ap.prompt;
+        } else {
+            for (const auto & m : messages) {
+                if (m.second.empty()) continue;
+                // Papel fora do ChatML vira "user": o Qwen so conhece
+                // system/user/assistant, e um papel inventado quebra o trilho.
+                std::string role = m.first;
+                if (role != "system" && role != "user" && role != "assistant") role = "user";
+                prompt_text += "<|im_start|>";
+                prompt_text += role;
+                prompt_text += "\n";
+                prompt_text += m.second;
+                prompt_text += "\n<|im_end|>\n";
+            }
+            prompt_text += "<|im_start|>assistant\n";
+        }
+
+        // Dial por MODELO, não global: a família Qwen3.5 emite bloco
+        // <think> espontaneamente; injetar um <think></think> vazio e já
+        // fechado suprime isso. Mas o Qwen3 NÃO usa think — nele o bloco
+        // pré-fechado faz o modelo concluir que o turno acabou e emitir
+        // EOS de cara (decode: 0 toks, resposta vazia). Por isso é opt-in:
+        // ligue POLARIS_SUPPRESS_THINK=1 só ao servir um modelo 3.5.
+        if (env_bool("POLARIS_SUPPRESS_THINK", false)) {
+            prompt_text += "<think>\n\n</think>\n";
+        }
+        tracer.record("template_render", t_render0, tracer.now_us(), (int64_t) prompt_text.size());
+
+        if (STAGE == "prompt")
+            return prompt_text;
+
+        // Tokenização correta pro Qwen3
+        // - specials ON
+        // - BOS conforme vocab (false)
+
+        const bool use_specials = params.special;
+        const bool add_bos_tok = llama_vocab_get_add_bos(vocab);
+
+        LOG_INF("tokenize: use_specials=%d | add_bos=%d\n",
+        (int)use_specials, (int)add_bos_tok);
+
+
+        int64_t t_tok0 = tracer.start();
+        std::vector<llama_token> embd_inp = common_tokenize(ctx, prompt_text, add_bos_tok, use_specials);
+        tracer.record("tokenize", t_tok0, tracer.now_us(), (int64_t) embd_inp.size());
+        LOG_INF("tokenize: produced %zu tokens\n", embd_inp.size());
+        if (embd_inp.empty()) {
+            if (add_bos_tok) embd_inp.push_back(llama_vocab_bos(vocab));
+            else throw std::runtime_error("Entrada vazia após tokenização");
+        }
+        if (STAGE == "tokenize") return std::string("[OK] tokenize: ") + std::to_string(embd_inp.size()) + " toks";
+
+        // limites de contexto e aparo preventivo do prompt para caber com margem
+        const int n_ctx_local = llama_n_ctx(ctx);
+        if ((int) embd_inp.size() > n_ctx_local - safety_margin) {
+            const int keep = n_ctx_local - safety_margin;
+            embd_inp.erase(embd_inp.begin(), embd_inp.end() - keep);
+            LOG_WRN("prompt aparado para %d tokens para caber no contexto\n", keep);
+        }
+
+        // ---- push_tokens SEGURO com llama_batch_init/free ----
+        // span: nome do span de decode no tracer ("prefill_ubatch" / "decode")
+        auto push_tokens = [&](const llama_token * toks, int n_toks, const char * span) {
+            const int n_ctx_here  = llama_n_ctx(ctx);
+            int       ubatch      = params.n_ubatch > 0 ? params.n_ubatch : 128;
+            const int MIN_UB      = 16;
+
+            auto make_batch = [&](int n, int offset) {
+                llama_batch batch = llama_batch_init(n, 0, 1);
+                batch.n_tokens = n;
+                for (int k = 0; k < n; ++k) {
+                    batch.token[k]     = toks[offset + k];
+                    batch.pos[k]       = (int) (n_past + k);
+                    batch.logits[k]    = (k == n - 1);
+                    batch.n_seq_id[k]  = 1;
+                    batch.seq_id[k][0] = 0; // seq única
+                }
+                return batch;
+            };
+
+            for (int i = 0; i < n_toks; ) {
+                int room = n_ctx_here - safety_margin - (int) n_past;
+                if (room <= 0) {
+                    LOG_WRN("room<=0 ao empurrar %d; n_ctx=%d safety=%d n_past=%zu\n",
+                            n_toks - i, n_ctx_here, safety_margin, n_past);
+                    throw std::runtime_error("Sem espaço no contexto (room<=0)");
+                }
+
+                int n_eval = std::min({ n_toks - i, ubatch, room });
+
+                llama_batch batch = make_batch(n_eval, i);
+
+                bool ok = false;
+                int  try_ub = n_eval;
+                while (!ok) {
+                    int64_t t_dec0 = tracer.start();
+                    int rc = llama_decode(ctx, batch);
+                    tracer.record(rc != 0 ? "decode_backoff" : span,
+                                  t_dec0, tracer.now_us(), n_eval);
+                    if (rc == 0) {
+                        ok = true;
+                        break;
+                    }
+                    // backoff: diminui o tamanho do batch
+                    llama_batch_free(batch);
+
+                    try_ub = std::max(MIN_UB, try_ub / 2);
+                    int next_n_eval = std::min(try_ub, room);
+                    if (next_n_eval >= n_eval) {
+                        throw std::runtime_error("llama_decode falhou (backoff esgotado)");
+                    }
+                    n_eval = next_n_eval;
+
+                    batch = make_batch(n_eval, i);
+                }
+
+                llama_batch_free(batch);
+
+                kv_tokens.insert(kv_tokens.end(), toks + i, toks + i + n_eval);
+                n_past += n_eval;
+                i      += n_eval;
+            }
+        };
+
+        // ---- REUSO DE PREFIXO ----
+        // O que ja esta no KV e igual ao inicio do prompt novo nao e
+        // recalculado: corta o KV no primeiro token divergente e so o resto
+        // passa pelo prefill. O ultimo token do prompt sempre e reavaliado,
+        // porque o sampler precisa dos logits dele.
+        size_t n_keep = 0;
+        while (n_keep < kv_tokens.size() && n_keep < embd_inp.size() &&
+               kv_tokens[n_keep] == embd_inp[n_keep]) ++n_keep;
+        if (n_keep == embd_inp.size() && n_keep > 0) --n_keep;
+        if (n_keep < kv_tokens.size()) {
+            if (llama_memory_seq_rm(llama_get_memory(ctx), 0, (llama_pos) n_keep, -1)) {
+                kv_tokens.resize(n_keep);
+                n_past = n_keep;
+            } else {
+                // memoria que nao aceita corte parcial (recorrente): recomeça
+                kv_clear();
+                n_keep = 0;
+            }
+        }
+
+        // ---- PREFILL ----
+        auto t_prefill0 = std::chrono::steady_clock::now();
+        {
+            TraceSpan span(tracer, "prefill", (int64_t) (embd_inp.size() - n_keep));
+            push_tokens(embd_inp.data() + n_keep, (int) (embd_inp.size() - n_keep), "prefill_ubatch");
+        }
+        auto t_prefill1 = std::chrono::steady_clock::now();
+        double prefill_sec = std::chrono::duration<double>(t_prefill1 - t_prefill0).count();
+        const size_t n_prefilled = embd_inp.size() - n_keep;
+        LOG_INF("prefill: %zu toks em %.3fs (%.1f tok/s) | reusados do KV: %zu\n",
+                n_prefilled, prefill_sec,
+                n_prefilled ? (n_prefilled/std::max(1e-9, prefill_sec)) : 0.0, n_keep);
+        // accept_grammar: precisa ser true quando há gramática, senão o estado dela
+        // não avança e o constraint não vale. No prompt (embd_inp) segue false —
+        // a gramática vale para o que o MODELO gera, não para o que ele leu.
+        const bool use_grammar = !grammar.empty();
+
+        // Tool-call tokens (tok_call_start/end, achados no load) são detectados
+        // mas, por enquanto, seguem no fluxo de texto normal: separá-los de
+        // verdade exige protocolar o canal de streaming.
+        for (auto t : embd_inp) common_sampler_accept(smpl.get(), t, /*grammar*/false);
+        if (STAGE == "prefill") return std::string("[OK] prefill in ") + std::to_string(prefill_sec) + "s";
+
+        // ---- ROOM PÓS-PREFILL ----
+        int room = n_ctx_local - safety_margin - (int) n_past;
+        if (room <= 0) {
+            LOG_WRN("sem espaço para decodificar (room<=0) após prefill; n_ctx=%d safety=%d n_past=%zu embd=%zu\n",
+                    n_ctx_local, safety_margin, n_past, embd_inp.size());
+            return std::string{};
+        }
+
+        // ---- estágios de diagnóstico (sample/piece/push) ----
+        if (STAGE == "sample" || STAGE == "piece" || STAGE == "push") {
+            llama_token sid = common_sampler_sample(smpl.get(), ctx, -1);
+            if (STAGE == "sample") return std::string("[OK] sample id=") + std::to_string(sid);
+
+            std::string_view piece = piece_of(sid, params.special);
+            if (STAGE == "piece") return std::string("[OK] piece len=") + std::to_string(piece.size());
+
+            push_tokens(&sid, 1, "decode");
+            return std::string("[OK] push one; piece len=") + std::to_string(piece.size());
+        }
+
+        // ---- clamp n_remain ----
+        int n_remain = (n_predict > 0 ? n_predict : 256);
+        if (room < n_remain) {
+            n_remain = room;
+            LOG_WRN("reduzindo n_predict para %d para não estourar contexto\n", n_remain);
+        }
+
+        // ---- geração ----
+        std::string out;
+        std::string buf;
+
+        const size_t FLUSH_BYTES  = (size_t) env_int("POLARIS_FLUSH",   64);  // bytes
+        const int    TOK_FLUSH    = env_int("POLARIS_TOKFLUSH",          1);  // a cada N tokens
+        const int    MS_FLUSH     = env_int("POLARIS_MS_FLUSH",        100);  // flush temporal (ms)
+
+        out.reserve((size_t) n_remain * 8);
+        buf.reserve(FLUSH_BYTES + 64);
+
+        // Entrega so ate o ultimo code point completo; a cauda de um caractere
+        // partido fica em buf e sai junto com o token seguinte.
+        bool cancelled = false;
+        auto flush_cb = [&](bool force=false) {
+            if (!on_chunk) return;
+            const size_t n = utf8_complete_len(buf);
+            if (n > 0 || force) {
+                TraceSpan span(tracer, "flush", (int64_t) n);
+                if (!on_chunk(buf.data(), n)) cancelled = true;
+                buf.erase(0, n);
+            }
+        };
+
+        size_t toks_generated   = 0;
+        size_t tok_since_flush  = 0;
+        auto   t_decode0        = std::chrono::steady_clock::now();
+        auto   t_last50         = t_decode0;
+        auto   t_last_flush     = t_decode0;
+
+        const int MAX_STEPS = std::max(1, n_remain); // limite duro
+        int steps = 0;
+
+        auto json_complete = [](const std::string &s) -> bool {
+            int braces = 0, brackets = 0;
+            bool in_str = false;
+            bool esc = false;
+            bool started = false;
+
+            for (char c : s) {
+                if (esc) { esc = false; continue; }
+                if (c == '\\') { esc = true; continue; }
+
+                if (c == '"') {
+                    in_str = !in_str;
+                    continue;
+                }
+                if (in_str) continue;
+
+                if (c == '{') { braces++; started = true; }
+                else if (c == '}') { braces--; }
+                else if (c == '[') { brackets++; started = true; }
+                else if (c == ']') { brackets--; }
+            }
+
+            return started && braces == 0 && brackets == 0 && !in_str;
+        };
+
+        // Intervalo entre tokens visto pelo stream: do texto de um token
+        // pronto ate o texto do seguinte pronto.
+        std::vector<float> itl_ms;
+        itl_ms.reserve((size_t) n_remain);
+        auto t_prev_tok = t_decode0;
+        bool first_tok  = true;
+
+        // emit: tudo que o token gerado faz DEPOIS do sample — piece, stop
+        // cedo do XCT, flush pro consumidor. false = parar (JSON fechou ou o
+        // consumidor cancelou); nesse caso o token NAO deve ficar no KV.
+        auto emit = [&](llama_token id) -> bool {
+            // Tool-call por TOKEN: detectamos os tokens especiais se existirem
+            // no vocabulário. Por hora o conteúdo segue no fluxo de texto; a
+            // separação estruturada exige protocolar o stream no cliente.
+            (void)tok_call_start; (void)tok_call_end;
+
+            // convert token -> text piece (view na tabela, sem alocar)
+            int64_t t_detok0 = tracer.start();
+            const std::string_view piece = piece_of(id, params.special);
+
+            // NOTA: houve aqui um "canal separado" que desviava o conteúdo do
+            // tool_call para um buffer próprio, anexado ao final da resposta. A
+            // intenção era não deixar a chamada virar texto (como fazem os
+            // provedores), mas ficou pela metade: o STREAM não via a chamada e o
+            // resultado final a recebia grudada no fim — fora da posição em que
+            // o modelo a emitiu. Isso desalinhava o texto e produzia fragmentos
+            // soltos quando o stream cortava no meio. Revertido: o piece segue o
+            // fluxo normal, na ordem gerada. A separação real exige tratar o
+            // protocolo inteiro (stream + final), não só a saída.
+
+            buf.append(piece.data(), piece.size());
+            out.append(piece.data(), piece.size());
+            tracer.record("detokenize", t_detok0, tracer.now_us(), (int64_t) piece.size());
+
+            // STOP cedo do XCT: procura sinalizadores e só para quando o JSON
+            // estiver balanceado. Isso evita parada no meio de uma string
+            // que por acaso contenha "done".
+            // Varre out inteiro a cada token: cresce com a saida, por isso
+            // tem span proprio.
+            int64_t t_stop0 = tracer.start();
+            bool has_key =
+                (out.find("\"done\"")      != std::string::npos) ||
+                (out.find("\"next_step\"") != std::string::npos);
+            const bool json_done = has_key && json_complete(out);
+            tracer.record("stop_check", t_stop0, tracer.now_us(), (int64_t) out.size());
+
+            auto now = std::chrono::steady_clock::now();
+            if (!first_tok) itl_ms.push_back(std::chrono::duration<float, std::milli>(now - t_prev_tok).count());
+            t_prev_tok = now;
+            first_tok  = false;
+
+            if (json_done) {
+                flush_cb(true);
+                return false;
+            }
+
+            // flushing streaming
+            if (on_chunk) {
+                bool by_bytes = buf.size() >= FLUSH_BYTES;
+                bool by_toks  = (TOK_FLUSH > 0) && (++tok_since_flush >= (size_t)TOK_FLUSH);
+                bool by_time  = false;
+                if (MS_FLUSH > 0) {
+                    if (std::chrono::duration_cast<std::chrono::milliseconds>(now - t_last_flush).count() >= MS_FLUSH) {
+                        by_time = true;
+                        t_last_flush = now;
+                    }
+                }
+
+                if (by_bytes || by_toks || by_time) {
+                    flush_cb();
+                    tok_since_flush = 0;
+                }
+                if (cancelled) {
+                    LOG_INF("decode: cancelado pelo consumidor do stream\n");
+                    return false;
+                }
+            }
+            return true;
+        };
+
+        auto after_push = [&]() {
+            // bookkeeping
+            --n_remain;
+            ++toks_generated;
+            ++steps;
+
+            // perf log every 50 tokens
+            if (toks_generated % 50 == 0) {
+                auto now = std::chrono::steady_clock::now();
+                double dt = std::chrono::duration<double>(now - t_last50).count();
+
+                LOG_INF("decode: +50 toks em %.3fs (%.1f tok/s)\n",
+                        dt, 50.0 / std::max(1e-9, dt));
+
+                t_last50 = now;
+            }
+        };
+
+        // POLARIS_PIPELINE=1: o decode do token N sai assim que o id e
+        // conhecido, e o emit dele (piece, stop, flush — inclusive o GIL e o
+        // callback Python) roda numa thread auxiliar AO MESMO TEMPO que o
+        // llama_decode. No serial essa parte soma direto no intervalo entre
+        // tokens.
+        //
+        // O preco: o stop (JSON fechou / cancelamento) chega atrasado, com
+        // ate POLARIS_PIPELINE_DEPTH tokens (o do stop incluido) ja no KV.
+        // Esses tokens saem do KV (llama_memory_seq_rm + kv_tokens) pra
+        // sessao e o reuso de prefixo verem exatamente o que o serial deixaria.
+        const bool pipelined  = env_bool("POLARIS_PIPELINE", false);
+        const int  pipe_depth = env_int("POLARIS_PIPELINE_DEPTH", 2);
+        size_t     overrun    = 0;
+
+        if (!pipelined) {
+            while (n_remain > 0 && steps < MAX_STEPS) {
+
+                // --- sample next token ---
+                llama_token id;
+                {
+                    TraceSpan span(tracer, "sample");
+                    id = common_sampler_sample(smpl.get(), ctx, -1);
+
+                    // accept sampled token
+                    common_sampler_accept(smpl.get(), id, /*grammar*/use_grammar);
+                }
+
+                // stop if end-of-generation token
+                if (llama_vocab_is_eog(vocab, id)) {
+                    break;
+                }
+
+                if (!emit(id)) break;
+
+                // ============================================================
+                // push generated token back into context
+                // ============================================================
+                push_tokens(&id, 1, "decode");
+                after_push();
+            }
+        } else {
+            // fila main -> auxiliar. n_done = tokens ja emitidos; stop_at =
+            // indice do token em que o emit mandou parar (-1 = nao parou).
+            std::mutex                 q_mtx;
+            std::condition_variable    q_cv;
+            std::deque<llama_token>    q;
+            size_t                     n_posted = 0, n_done = 0;
+            bool                       closed   = false;
+            std::atomic<long>          stop_at{ -1 };
+            std::exception_ptr         emit_error;
+
+            std::thread helper([&]() {
+                for (;;) {
+                    llama_token id;
+                    {
+                        std::unique_lock<std::mutex> lk(q_mtx);
+                        q_cv.wait(lk, [&] { return closed || !q.empty(); });
+                        if (q.empty()) return;
+                        id = q.front();
+                        q.pop_front();
+                    }
+                    bool keep = false;
+                    try {
+                        keep = emit(id);
+                    } catch (...) {
+                        emit_error = std::current_exception();
+                    }
+                    std::lock_guard<std::mutex> lk(q_mtx);
+                    if (!keep) {
+                        stop_at.store((long) n_done);
+                        q.clear();
+                        closed = true;
+                    }
+                    ++n_done;
+                    q_cv.notify_all();
+                }
+            });
+
+            const size_t kv_gen0 = kv_tokens.size();
+            try {
+                while (n_remain > 0 && steps < MAX_STEPS && stop_at.load() < 0) {
+                    llama_token id;
+                    {
+                        TraceSpan span(tracer, "sample");
+                        id = common_sampler_sample(smpl.get(), ctx, -1);
+                        common_sampler_accept(smpl.get(), id, /*grammar*/use_grammar);
+                    }
+                    if (llama_vocab_is_eog(vocab, id)) {
+                        break;
+                    }
+
+                    // nao deixa o decode correr mais que pipe_depth tokens a
+                    // frente do stream: limita o que um stop atrasado desperdica
+                    {
+                        std::unique_lock<std::mutex> lk(q_mtx);
+                        {
+                            TraceSpan span(tracer, "pipeline_wait");
+                            q_cv.wait(lk, [&] { return closed || n_posted - n_done < (size_t) pipe_depth; });
+                        }
+                        if (closed) break;
+                        q.push_back(id);
+                        ++n_posted;
+                    }
+                    q_cv.notify_all();
+
+                    push_tokens(&id, 1, "decode");
+                    after_push();
+                }
+            } catch (...) {
+                {
+                    std::lock_guard<std::mutex> lk(q_mtx);
+                    closed = true;
+                }
+                q_cv.notify_all();
+                helper.join();
+                throw;
+            }
+            {
+                std::lock_guard<std::mutex> lk(q_mtx);
+                closed = true;
+            }
+            q_cv.notify_all();
+            helper.join();
+
+            // stop atrasado: o token do stop e os seguintes ja estao no KV,
+            // mas no serial nunca teriam entrado
+            const long st = stop_at.load();
+            overrun = pipeline_overrun(kv_gen0, kv_tokens.size(), st);
+            if (overrun > 0) {
+                const size_t keep = kv_tokens.size() - overrun;
+                if (llama_memory_seq_rm(llama_get_memory(ctx), 0, (llama_pos) keep, -1)) {
+                    kv_tokens.resize(keep);
+                    n_past = keep;
+                } else {
+                    kv_clear();
+                }
+                toks_generated -= std::min(toks_generated, overrun);
+                LOG_INF("pipeline: stop no token %ld; %zu toks decodificados a mais removidos do KV\n",
+                        st, overrun);
+            }
+            if (emit_error) std::rethrow_exception(emit_error);
+        }
+
+
+        // Cauda partida pelo fim da geracao -> U+FFFD (ver ChunkFn); vale
+        // tambem pro retorno.
+        if (utf8_complete_len(out) < out.size()) {
+            out.resize(utf8_complete_len(out));
+            out += "\xEF\xBF\xBD";
+        }
+        if (utf8_complete_len(buf) < buf.size()) {
+            buf.resize(utf8_complete_len(buf));
+            buf += "\xEF\xBF\xBD";
+        }
+
+        // Flush final: o que sobrou vai inteiro.
+        if (on_chunk && !cancelled && !buf.empty()) {
+            TraceSpan span(tracer, "flush", (int64_t) buf.size());
+            on_chunk(buf.data(), buf.size());
+            buf.clear();
+        }
+
+        auto t_decode1 = std::chrono::steady_clock::now();
+        double decode_sec = std::chrono::duration<double>(t_decode1 - t_decode0).count();
+        LOG_INF("decode: %zu toks em %.3fs (%.1f tok/s)\n",
+                toks_generated, decode_sec,
+                toks_generated ? (toks_generated/std::max(1e-9, decode_sec)) : 0.0);
+
+        last_decode = decode_stats_from(itl_ms, pipelined, toks_generated, decode_sec * 1e3, overrun);
+        LOG_INF("decode: itl %s mean=%.2fms p50=%.2fms p95=%.2fms max=%.2fms\n",
+                pipelined ? "pipeline" : "serial",
+                last_decode.itl_mean_ms, last_decode.itl_p50_ms,
+                last_decode.itl_p95_ms, last_decode.itl_max_ms);
+
+        return out;
+    }
+};
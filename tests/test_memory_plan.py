@@ -0,0 +1,72 @@
+"""Mirror of the C++ planner helpers (layers_on_gpu / plan_memory ladder).
+
+The host share of weights decides whether the planner can shrink n_ctx at
+all: a CPU-only build keeps every layer in RAM whatever n_gpu_layers says.
+"""
+
+import pytest
+
+MIN_CTX = 256
+
+
+def layers_on_gpu(n_gpu_layers: int, n_layer: int, supports_offload: bool) -> int:
+    if not supports_offload:
+        return 0
+    if n_gpu_layers < 0:
+        return n_layer
+    return min(n_gpu_layers, n_layer)
+
+
+def host_weight_frac(n_gpu_layers: int, n_layer: int, supports_offload: bool) -> float:
+    if n_layer <= 0:
+        return 1.0
+    return (n_layer - layers_on_gpu(n_gpu_layers, n_layer, supports_offload)) / n_layer
+
+
+def ladder(k: str, v: str, v_quant: bool):
+    # relative row size per type (only the ordering matters)
+    size = {"f16": 16, "q8_0": 8.5, "q4_0": 4.5}
+    out = [(k, v)]
+    for t in ("q8_0", "q4_0"):
+        if size[t] < size[out[-1][0]]:
+            out.append((t, t if v_quant else v))
+    return out
+
+
+def want_ctx(n_ctx: int, n_ctx_train: int) -> int:
+    want = n_ctx if n_ctx > 0 else n_ctx_train
+    if n_ctx_train > 0:
+        want = min(want, n_ctx_train)
+    return max(MIN_CTX, want - want % MIN_CTX)
+
+
+@pytest.mark.parametrize(
+    "n_gpu_layers,supports,expected",
+    [
+        (999, False, 1.0),  # default n_gpu_layers=-1 becomes 999; CPU-only build
+        (-1, False, 1.0),
+        (999, True, 0.0),
+        (-1, True, 0.0),
+        (0, True, 1.0),
+        (8, True, 0.75),
+    ],
+)
+def test_host_weight_frac(n_gpu_layers, supports, expected):
+    assert host_weight_frac(n_gpu_layers, 32, supports) == pytest.approx(expected)
+
+
+def test_ladder_keeps_v_without_flash_attn():
+    assert ladder("f16", "f16", v_quant=False) == [
+        ("f16", "f16"),
+        ("q8_0", "f16"),
+        ("q4_0", "f16"),
+    ]
+    assert ladder("f16", "f16", v_quant=True)[-1] == ("q4_0", "q4_0")
+
+
+@pytest.mark.parametrize(
+    "n_ctx,n_ctx_train,expected",
+    [(4096, 32768, 4096), (4100, 32768, 4096), (128, 32768, 256), (0, 8192, 8192)],
+)
+def test_want_ctx(n_ctx, n_ctx_train, expected):
+    assert want_ctx(n_ctx, n_ctx_train) == expected
@@ -0,0 +1,118 @@
+"""Mirror of the pipelined decode bookkeeping (POLARIS_PIPELINE=1).
+
+The main loop decodes token N as soon as it is sampled; the helper thread
+emits it (piece, early-stop, callback) later. When the helper stops at
+token j, the main loop may already have decoded tokens up to k > j. Those
+must leave the KV so it ends exactly as the serial loop would leave it:
+prompt + generated tokens before the stop token.
+"""
+
+from typing import List, Optional, Tuple
+
+import pytest
+
+EOG = -1
+
+
+def pipeline_overrun(kv_gen0: int, kv_size: int, stop_at: int) -> int:
+    if stop_at < 0:
+        return 0
+    keep = kv_gen0 + stop_at
+    return kv_size - keep if kv_size > keep else 0
+
+
+def run_serial(prompt: List[int], sampled: List[int], stop_idx: Optional[int], n_remain: int):
+    kv = list(prompt)
+    generated = 0
+    for i, tok in enumerate(sampled[:n_remain]):
+        if tok == EOG:
+            break
+        if i == stop_idx:  # emit returned False: not pushed
+            break
+        kv.append(tok)
+        generated += 1
+    return kv, generated
+
+
+def run_pipelined(
+    prompt: List[int], sampled: List[int], stop_idx: Optional[int], n_remain: int, depth: int
+) -> Tuple[List[int], int, int, int]:
+    """Worst case for the late stop: the helper only runs when the main
+    loop is blocked on the depth limit, and drains the rest after join."""
+    kv = list(prompt)
+    kv_gen0 = len(kv)
+    queue: List[int] = []
+    n_posted = n_done = 0
+    closed = False
+    stop_at = -1
+    generated = 0
+
+    def helper_step() -> None:
+        nonlocal n_done, closed, stop_at
+        queue.pop(0)
+        if n_done == stop_idx:
+            stop_at = n_done
+            queue.clear()
+            closed = True
+        n_done += 1
+
+    for tok in sampled[:n_remain]:
+        if stop_at >= 0:
+            break
+        if tok == EOG:
+            break
+        while not closed and n_posted - n_done >= depth:
+            helper_step()
+        if closed:
+            break
+        queue.append(tok)
+        n_posted += 1
+        kv.append(tok)  # push_tokens
+        generated += 1
+
+    while queue and not closed:
+        helper_step()
+
+    overrun = pipeline_overrun(kv_gen0, len(kv), stop_at)
+    decoded_max = len(kv)
+    if overrun:
+        del kv[len(kv) - overrun :]
+    generated -= min(generated, overrun)
+    return kv, generated, overrun, decoded_max
+
+
+PROMPT = [100, 101, 102]
+
+
+@pytest.mark.parametrize("depth", [1, 2, 3, 4])
+@pytest.mark.parametrize(
+    "sampled,stop_idx,n_remain",
+    [
+        ([1, 2, 3, 4, 5, 6, 7, 8], 2, 8),  # stop mid-stream, main ran ahead
+        ([1, 2, 3, 4, 5, 6, 7, 8], 0, 8),  # stop on the first token
+        ([1, 2, 3, 4, 5, 6, 7, 8], None, 8),  # no stop
+        ([1, 2, 3, 4, 5, 6, 7, 8], 7, 8),  # stop on the last token of n_predict
+        ([1, 2, 3, EOG, 5, 6], 2, 6),  # main breaks on EOG after posting the stop token
+        ([1, 2, EOG, 4, 5], 3, 5),  # EOG before the stop would fire
+        ([1, 2, 3, 4, 5, 6], 4, 3),  # n_predict ends before the stop token
+    ],
+)
+def test_pipeline_matches_serial(sampled, stop_idx, n_remain, depth):
+    serial_kv, serial_gen = run_serial(PROMPT, sampled, stop_idx, n_remain)
+    kv, gen, overrun, decoded_max = run_pipelined(PROMPT, sampled, stop_idx, n_remain, depth)
+
+    assert kv == serial_kv
+    assert gen == serial_gen
+    # the stop token itself plus at most depth-1 tokens decoded past it
+    assert 0 <= overrun <= depth
+    if overrun:
+        # truncation range is [kv_gen0 + stop_idx, decoded_max)
+        assert decoded_max - overrun == len(PROMPT) + stop_idx
+
+
+def test_overrun_range():
+    # helper stopped at j=2 while main had pushed up to k=4 (5 generated)
+    assert pipeline_overrun(kv_gen0=3, kv_size=3 + 5, stop_at=2) == 3
+    # stop token never reached the KV (main blocked before pushing it)
+    assert pipeline_overrun(kv_gen0=3, kv_size=3 + 2, stop_at=2) == 0
+    assert pipeline_overrun(kv_gen0=3, kv_size=8, stop_at=-1) == 0
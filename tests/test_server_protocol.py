@@ -0,0 +1,46 @@
+"""Framing of the native polaris_server protocol, via the bundled client.
+
+Each frame is [1 byte type][4 bytes big-endian length][payload]; the
+response to one request is a run of 'C' chunks closed by 'D' or 'E'.
+"""
+
+import importlib.util
+import json
+import os
+import socket
+
+CLIENT_PATH = os.path.join(
+    os.path.dirname(os.path.dirname(__file__)), "xct-server", "polaris_client.py"
+)
+spec = importlib.util.spec_from_file_location("polaris_client", CLIENT_PATH)
+assert spec is not None and spec.loader is not None
+polaris_client = importlib.util.module_from_spec(spec)
+spec.loader.exec_module(polaris_client)
+
+
+def test_encode_frame_layout():
+    frame = polaris_client.encode_frame(b"R", b"{}")
+    assert frame == b"R\x00\x00\x00\x02{}"
+
+
+def test_iter_frames_stops_at_done():
+    server, client = socket.socketpair()
+    with server, client:
+        done = json.dumps({"bytes": 9, "ms": 1.0}).encode()
+        server.sendall(
+            polaris_client.encode_frame(b"C", "São ".encode())
+            + polaris_client.encode_frame(b"C", "Paulo".encode())
+            + polaris_client.encode_frame(b"D", done)
+            + polaris_client.encode_frame(b"C", b"next request")
+        )
+        frames = list(polaris_client.iter_frames(client))
+    assert [k for k, _ in frames] == [b"C", b"C", b"D"]
+    assert b"".join(p for k, p in frames if k == b"C").decode() == "São Paulo"
+
+
+def test_iter_frames_stops_at_error():
+    server, client = socket.socketpair()
+    with server, client:
+        server.sendall(polaris_client.encode_frame(b"E", b"boom"))
+        frames = list(polaris_client.iter_frames(client))
+    assert frames == [(b"E", b"boom")]
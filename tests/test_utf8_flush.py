@@ -0,0 +1,76 @@
+"""Mirror of the C++ utf8_complete_len used to align streaming flushes.
+
+Every chunk handed to the callback must decode as UTF-8 on its own; a
+multi-byte character split across tokens is held until it completes.
+"""
+
+import pytest
+
+
+def utf8_complete_len(s: bytes) -> int:
+    n = len(s)
+    for back in range(1, min(4, n) + 1):
+        c = s[n - back]
+        if (c & 0xC0) == 0x80:
+            continue
+        need = 1
+        if (c & 0xE0) == 0xC0:
+            need = 2
+        elif (c & 0xF0) == 0xE0:
+            need = 3
+        elif (c & 0xF8) == 0xF0:
+            need = 4
+        return n - back if back < need else n
+    return n
+
+
+@pytest.mark.parametrize(
+    "data,expected",
+    [
+        (b"", 0),
+        (b"abc", 3),
+        ("ação".encode(), len("ação".encode())),
+        ("a".encode() + "ç".encode()[:1], 1),
+        ("🙂".encode()[:3], 0),
+        ("x🙂".encode()[:4], 1),
+        ("x🙂".encode(), 5),
+        (b"\x80\x80\x80\x80", 4),
+    ],
+)
+def test_utf8_complete_len(data, expected):
+    assert utf8_complete_len(data) == expected
+
+
+def test_stream_is_lossless_and_valid():
+    text = "São Paulo → 東京 🙂 fim"
+    raw = text.encode()
+    buf = b""
+    chunks = []
+    for i in range(len(raw)):
+        buf += raw[i : i + 1]
+        n = utf8_complete_len(buf)
+        if n:
+            chunks.append(buf[:n])
+            buf = buf[n:]
+    chunks.append(buf)
+    for c in chunks:
+        c.decode("utf-8")
+    assert b"".join(chunks).decode("utf-8") == text
+
+
+def finish(buf: bytes) -> bytes:
+    """Mirror of the final flush: an incomplete tail becomes U+FFFD."""
+    n = utf8_complete_len(buf)
+    return buf if n == len(buf) else buf[:n] + "\ufffd".encode()
+
+
+@pytest.mark.parametrize(
+    "tail,expected",
+    [
+        (b"ok", "ok"),
+        ("x🙂".encode()[:3], "x\ufffd"),
+        ("東".encode()[:2], "\ufffd"),
+    ],
+)
+def test_final_flush_replaces_dangling_tail(tail, expected):
+    assert finish(tail).decode("utf-8") == expected
@@ -36,14 +36,16 @@ make -j"$(nproc)"
 
 # ── Step 2: Copia arquivos do polaris-core para examples/polaris ──
 echo ""
-echo "[2/4] Copiando polaris_bind.cpp e CMakeLists.txt para examples/polaris..."
+echo "[2/4] Copiando fontes e CMakeLists.txt para examples/polaris..."
 mkdir -p "$POLARIS_DIR"
 cp "$POLARIS_CORE_DIR/polaris_bind.cpp"        "$POLARIS_DIR/polaris_bind.cpp"
+cp "$POLARIS_CORE_DIR/polaris_engine.h"        "$POLARIS_DIR/polaris_engine.h"
+cp "$POLARIS_CORE_DIR/xct-server/polaris_server.cpp" "$POLARIS_DIR/polaris_server.cpp"
 cp "$POLARIS_CORE_DIR/xct-server/CMakeLists.txt" "$POLARIS_DIR/CMakeLists.txt"
 
 # ── Step 3: Compila polaris_core ──
 echo ""
-echo "[3/4] Compilando polaris_core (CUDA)..."
+echo "[3/4] Compilando polaris_core + polaris_server (CUDA)..."
 cd "$POLARIS_DIR"
 rm -rf build && mkdir build && cd build
 cmake .. -DPOLARIS_ENABLE_CUDA=ON
@@ -56,8 +58,9 @@ DEST="$XCT_SERVER_DIR"
 LIBS_DEST="$DEST/polaris_libs"
 mkdir -p "$LIBS_DEST"
 
-# modulo python
+# modulo python + servidor nativo
 cp "$POLARIS_DIR/build/polaris_core.cpython-"*.so "$DEST/polaris_core.so"
+cp "$POLARIS_DIR/build/polaris_server"              "$DEST/polaris_server"
 
 # libs compartilhadas (inclui versionadas .so.0, .so.0.x.y)
 cp "$LLAMA_ROOT/build-gpu/bin/libllama.so"*    "$LIBS_DEST/" 2>/dev/null || true
@@ -68,6 +71,8 @@ if command -v patchelf &> /dev/null; then
   echo "  Configurando RPATH com patchelf..."
   # shellcheck disable=SC2016
   patchelf --set-rpath '$ORIGIN/polaris_libs' "$DEST/polaris_core.so"
+  # shellcheck disable=SC2016
+  patchelf --set-rpath '$ORIGIN/polaris_libs' "$DEST/polaris_server"
   for lib in "$LIBS_DEST"/lib*.so; do
     # shellcheck disable=SC2016
     patchelf --set-rpath '$ORIGIN' "$lib" 2>/dev/null || true
@@ -88,4 +93,7 @@ echo ""
 echo "  Para rodar o xct-server:"
 echo "    cd $DEST"
 echo "    python xct_server.py"
+echo ""
+echo "  Ou o servidor nativo (sem Python no caminho do stream):"
+echo "    $DEST/polaris_server --model model.gguf --unix /tmp/polaris.sock"
 echo "============================================"
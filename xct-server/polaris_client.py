@@ -0,0 +1,103 @@
+#!/usr/bin/env python3
+"""
+Cliente de teste do polaris_server (frames com tamanho na frente).
+
+Manda um pedido e escreve o stream no stdout conforme os chunks chegam.
+O protocolo esta descrito no topo de polaris_server.cpp.
+
+    python polaris_client.py --unix /tmp/polaris.sock "Oi, tudo bem?"
+    python polaris_client.py --port 8765 --system "Responda em JSON." "status?"
+"""
+
+import argparse
+import json
+import socket
+import struct
+import sys
+from typing import Iterator, Tuple
+
+HEADER = struct.Struct(">cI")  # tipo (1 byte) + tamanho big-endian
+
+
+def encode_frame(kind: bytes, payload: bytes) -> bytes:
+    return HEADER.pack(kind, len(payload)) + payload
+
+
+def recv_exact(sock: socket.socket, n: int) -> bytes:
+    buf = bytearray()
+    while len(buf) < n:
+        part = sock.recv(n - len(buf))
+        if not part:
+            raise ConnectionError("conexao fechada pelo servidor")
+        buf += part
+    return bytes(buf)
+
+
+def iter_frames(sock: socket.socket) -> Iterator[Tuple[bytes, bytes]]:
+    """Frames da resposta de UM pedido, ate o 'D' (fim) ou 'E' (erro)."""
+    while True:
+        kind, size = HEADER.unpack(recv_exact(sock, HEADER.size))
+        payload = recv_exact(sock, size) if size else b""
+        yield kind, payload
+        if kind in (b"D", b"E"):
+            return
+
+
+def connect(args: argparse.Namespace) -> socket.socket:
+    if args.unix:
+        sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        sock.connect(args.unix)
+    else:
+        sock = socket.create_connection((args.host, args.port))
+    return sock
+
+
+def main() -> int:
+    ap = argparse.ArgumentParser(description="Cliente de teste do polaris_server")
+    ap.add_argument("prompt")
+    ap.add_argument("--unix", default="")
+    ap.add_argument("--host", default="127.0.0.1")
+    ap.add_argument("--port", type=int, default=8765)
+    ap.add_argument("--system", default="")
+    ap.add_argument("--session", default="")
+    ap.add_argument("--adapter", default="")
+    ap.add_argument("--adapter-scale", type=float, default=1.0)
+    ap.add_argument("--grammar-file", default="")
+    ap.add_argument("--n-predict", type=int, default=256)
+    ap.add_argument("--temperature", type=float, default=0.7)
+    args = ap.parse_args()
+
+    messages = []
+    if args.system:
+        messages.append(["system", args.system])
+    messages.append(["user", args.prompt])
+
+    req = {
+        "messages": messages,
+        "session": args.session,
+        "adapter": args.adapter,
+        "adapter_scale": args.adapter_scale,
+        "n_predict": args.n_predict,
+        "temperature": args.temperature,
+    }
+    if args.grammar_file:
+        with open(args.grammar_file, "r", encoding="utf-8") as f:
+            req["grammar"] = f.read()
+
+    with connect(args) as sock:
+        sock.sendall(encode_frame(b"R", json.dumps(req).encode("utf-8")))
+        for kind, payload in iter_frames(sock):
+            if kind == b"C":
+                sys.stdout.write(payload.decode("utf-8"))
+                sys.stdout.flush()
+            elif kind == b"D":
+                stats = json.loads(payload)
+                print(f"\n[{stats['bytes']} bytes em {stats['ms']:.0f}ms]", file=sys.stderr)
+            else:
+                print(f"\nerro: {payload.decode('utf-8', 'replace')}", file=sys.stderr)
+                return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
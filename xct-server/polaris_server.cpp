@@ -0,0 +1,453 @@
+// polaris_server: o PolarisEngine servido direto num socket, sem Python.
+//
+// Por que existe: o caminho de producao era web Python -> Engine.generate_chat
+// -> callback por chunk. Cada flush pagava a disputa pelo GIL e uma copia pra
+// py::bytes. Aqui o chunk sai do buffer do engine direto pro socket (writev
+// com o cabecalho do frame + o ponteiro do proprio buffer: zero copia).
+//
+// Protocolo: frames com tamanho na frente, mesmo formato nos dois sentidos.
+//
+//   [1 byte tipo][4 bytes tamanho do payload, big-endian][payload]
+//
+//   cliente -> servidor
+//     'R'  pedido, JSON:
+//          {"messages": [["system", "..."], ["user", "..."]],
+//           "grammar": "...", "session": "abc", "n_predict": 256,
+//           "temperature": 0.7, "top_p": 0.9, "repeat_penalty": 1.1,
+//           "top_k": 40, "min_p": 0.05, "penalty_freq": 0.0,
+//           "penalty_present": 0.0, "seed": -1,
+//           "adapter": "sql", "adapter_scale": 1.0}
+//          messages tambem aceita [{"role": "...", "content": "..."}].
+//
+//   servidor -> cliente
+//     'C'  pedaco do stream (mesmo recorte do ChunkFn do engine)
+//     'D'  fim do pedido, JSON: {"bytes": N, "ms": T}
+//     'E'  erro, texto
+//
+// Varios pedidos na mesma conexao sao atendidos em ordem. O cliente mantem
+// o lado de escrita aberto ate o ultimo 'D': EOF cancela o que estiver na
+// fila e o pedido em curso; um cliente que para de ler por mais de
+// WRITE_STALL_MS com o buffer do socket cheio tambem e cancelado.
+//
+// Um unico engine (um contexto) atende todo mundo, um pedido por vez: o
+// event loop aceita e le as conexoes, e a thread de geracao escreve nos
+// sockets. As sessoes do engine (session=) mantem o KV de cada conversa
+// entre pedidos.
+
+#include "polaris_engine.h"
+
+#include <nlohmann/json.hpp>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <csignal>
+#include <cerrno>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+using json = nlohmann::json;
+
+static constexpr size_t MAX_FRAME      = 64u << 20;  // 64 MB
+// Uma thread de geracao escreve em todas as conexoes: um cliente que para
+// de ler nao pode segurar as outras. O buffer do socket (SNDBUF) e a folga
+// por conexao; cheio e sem drenar por WRITE_STALL_MS = cliente travado,
+// cancela.
+static constexpr int    SEND_BUF_BYTES = 1 << 20;
+static constexpr int    WRITE_STALL_MS = 200;
+
+static std::atomic<bool> g_stop{ false };
+
+struct Conn {
+    int               fd;
+    std::string       inbuf;
+    std::atomic<bool> dead{ false };
+
+    explicit Conn(int f) : fd(f) {}
+    ~Conn() { ::close(fd); }  // fecha so quando ninguem mais segura a conexao
+};
+using ConnPtr = std::shared_ptr<Conn>;
+
+// Escreve tudo (socket nao-bloqueante: espera POLLOUT no EAGAIN, no maximo
+// WRITE_STALL_MS). false = cliente sumiu ou travou; a conexao fica marcada
+// como morta.
+static bool write_all(Conn & c, struct iovec * iov, int iovcnt) {
+    while (iovcnt > 0) {
+        if (c.dead) return false;
+        ssize_t n = ::writev(c.fd, iov, iovcnt);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                struct pollfd p{ c.fd, POLLOUT, 0 };
+                if (::poll(&p, 1, WRITE_STALL_MS) <= 0 || (p.revents & (POLLERR | POLLHUP))) {
+                    c.dead = true;
+                    return false;
+                }
+                continue;
+            }
+            c.dead = true;
+            return false;
+        }
+        while (iovcnt > 0 && (size_t) n >= iov->iov_len) {
+            n -= (ssize_t) iov->iov_len;
+            ++iov;
+            --iovcnt;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *) iov->iov_base + n;
+            iov->iov_len -= (size_t) n;
+        }
+    }
+    return true;
+}
+
+static bool send_frame(Conn & c, char type, const char * data, size_t n) {
+    unsigned char hdr[5];
+    hdr[0] = (unsigned char) type;
+    const uint32_t be = htonl((uint32_t) n);
+    std::memcpy(hdr + 1, &be, 4);
+    struct iovec iov[2] = {
+        { hdr, sizeof(hdr) },
+        { const_cast<char *>(data), n },
+    };
+    return write_all(c, iov, n ? 2 : 1);
+}
+
+// ---- fila de pedidos: event loop -> thread de geracao ----
+struct Job {
+    ConnPtr     conn;
+    std::string payload;
+};
+
+struct JobQueue {
+    std::mutex              mtx;
+    std::condition_variable cv;
+    std::deque<Job>         jobs;
+
+    void push(Job j) {
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            jobs.push_back(std::move(j));
+        }
+        cv.notify_one();
+    }
+
+    bool pop(Job & out) {
+        std::unique_lock<std::mutex> lk(mtx);
+        cv.wait(lk, [this] { return g_stop || !jobs.empty(); });
+        if (g_stop || jobs.empty()) return false;
+        out = std::move(jobs.front());
+        jobs.pop_front();
+        return true;
+    }
+
+    // Encerramento: os pedidos que ainda nao comecaram nao rodam; as
+    // conexoes deles morrem (e o pedido em curso na mesma conexao cancela).
+    void cancel_all() {
+        std::lock_guard<std::mutex> lk(mtx);
+        for (auto & j : jobs) j.conn->dead = true;
+        jobs.clear();
+    }
+};
+
+static void serve_job(PolarisEngine & eng, Job & job) {
+    Conn & c = *job.conn;
+    if (c.dead || g_stop) return;  // cliente ja foi embora: nem faz o prefill
+
+    auto t0 = std::chrono::steady_clock::now();
+    try {
+        const json req = json::parse(job.payload);
+
+        std::vector<PolarisEngine::ChatMsg> msgs;
+        for (const auto & m : req.at("messages")) {
+            if (m.is_array()) msgs.emplace_back(m.at(0).get<std::string>(), m.at(1).get<std::string>());
+            else              msgs.emplace_back(m.value("role", "user"), m.value("content", ""));
+        }
+
+        // o chunk vai do buffer do engine direto pro socket; encerrando o
+        // servidor, a geracao em curso para no proximo chunk
+        PolarisEngine::ChunkFn on_chunk = [&c](const char * data, size_t n) {
+            return !g_stop && (n == 0 || send_frame(c, 'C', data, n));
+        };
+
+        const std::string out = eng.generate_chat(
+            msgs,
+            req.value("n_predict",       256),
+            req.value("temperature",     0.7),
+            req.value("top_p",           0.9),
+            req.value("repeat_penalty",  1.1),
+            req.value("top_k",           40),
+            req.value("min_p",           0.05),
+            req.value("penalty_freq",    0.0),
+            req.value("penalty_present", 0.0),
+            req.value("seed",            -1),
+            req.value("grammar",         std::string()),
+            on_chunk,
+            req.value("session",         std::string()),
+            req.value("adapter",         std::string()),
+            req.value("adapter_scale",   1.0));
+
+        const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+        const std::string done = json{ { "bytes", out.size() }, { "ms", ms } }.dump();
+        send_frame(c, 'D', done.data(), done.size());
+    } catch (const std::exception & e) {
+        LOG_WRN("server: pedido falhou: %s\n", e.what());
+        const std::string msg = e.what();
+        send_frame(c, 'E', msg.data(), msg.size());
+    }
+}
+
+// Corta os frames completos de inbuf. false = frame invalido (fecha a conexao).
+static bool drain_frames(const ConnPtr & c, JobQueue & q) {
+    size_t off = 0;
+    while (c->inbuf.size() - off >= 5) {
+        const unsigned char * p = (const unsigned char *) c->inbuf.data() + off;
+        uint32_t be;
+        std::memcpy(&be, p + 1, 4);
+        const size_t len = ntohl(be);
+        if (p[0] != 'R' || len > MAX_FRAME) return false;
+        if (c->inbuf.size() - off - 5 < len) break;
+        q.push(Job{ c, c->inbuf.substr(off + 5, len) });
+        off += 5 + len;
+    }
+    c->inbuf.erase(0, off);
+    return true;
+}
+
+static int listen_on(const std::string & unix_path, const std::string & host, int port) {
+    int fd;
+    if (!unix_path.empty()) {
+        fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        struct sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        if (unix_path.size() >= sizeof(addr.sun_path))
+            throw std::runtime_error("caminho do socket unix longo demais");
+        std::strcpy(addr.sun_path, unix_path.c_str());
+        ::unlink(unix_path.c_str());
+        if (::bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+            throw std::runtime_error("bind " + unix_path + ": " + std::strerror(errno));
+    } else {
+        fd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        int one = 1;
+        ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        struct sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port   = htons((uint16_t) port);
+        if (::inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1)
+            throw std::runtime_error("host invalido: " + host);
+        if (::bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+            throw std::runtime_error("bind " + host + ":" + std::to_string(port) + ": " + std::strerror(errno));
+    }
+    if (::listen(fd, 128) < 0)
+        throw std::runtime_error(std::string("listen: ") + std::strerror(errno));
+    return fd;
+}
+
+static void on_signal(int) { g_stop = true; }
+
+static void usage(const char * argv0) {
+    std::fprintf(stderr,
+        "uso: %s --model PATH [--unix PATH | --host H --port P]\n"
+        "       [--ctx N] [--threads N] [--gpu-layers N]\n"
+        "       [--cache-type-k T] [--cache-type-v T] [--flash-attn auto|on|off]\n"
+        "       [--ram-budget-mb N] [--no-mmap] [--mlock] [--no-kv-offload] [--warmup]\n"
+        "       [--lora NOME=PATH[,NOME=PATH...]]\n",
+        argv0);
+}
+
+int main(int argc, char ** argv) {
+    std::map<std::string, std::string> opt;
+    for (int i = 1; i < argc; ++i) {
+        std::string a = argv[i];
+        if (a == "-h" || a == "--help") { usage(argv[0]); return 0; }
+        if (a == "--warmup" || a == "--no-mmap" || a == "--mlock" || a == "--no-kv-offload") {
+            opt[a] = "1";
+        } else if (a.rfind("--", 0) == 0 && i + 1 < argc) {
+            opt[a] = argv[++i];
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    auto get = [&](const char * k, const std::string & defv) {
+        auto it = opt.find(k);
+        return it == opt.end() ? defv : it->second;
+    };
+    if (!opt.count("--model")) { usage(argv[0]); return 1; }
+
+    // --lora sql=/m/sql.gguf,shell=/m/shell.gguf
+    std::vector<std::pair<std::string, std::string>> loras;
+    {
+        std::string spec = get("--lora", "");
+        size_t pos = 0;
+        while (pos < spec.size()) {
+            size_t end = spec.find(',', pos);
+            if (end == std::string::npos) end = spec.size();
+            const std::string item = spec.substr(pos, end - pos);
+            const size_t eq = item.find('=');
+            if (eq == std::string::npos || eq == 0 || eq + 1 == item.size()) {
+                std::fprintf(stderr, "polaris_server: --lora espera NOME=PATH, veio '%s'\n", item.c_str());
+                return 1;
+            }
+            loras.emplace_back(item.substr(0, eq), item.substr(eq + 1));
+            pos = end + 1;
+        }
+    }
+
+    std::signal(SIGPIPE, SIG_IGN);
+    std::signal(SIGINT,  on_signal);
+    std::signal(SIGTERM, on_signal);
+
+    int lfd;
+    try {
+        lfd = listen_on(get("--unix", ""), get("--host", "127.0.0.1"), std::stoi(get("--port", "8765")));
+    } catch (const std::exception & e) {
+        std::fprintf(stderr, "polaris_server: %s\n", e.what());
+        return 1;
+    }
+
+    // async: o socket ja aceita conexoes enquanto o modelo carrega; os
+    // pedidos que chegarem antes esperam o load na thread de geracao.
+    std::unique_ptr<PolarisEngine> eng;
+    try {
+        eng = std::make_unique<PolarisEngine>(
+            get("--model", ""),
+            std::stoi(get("--ctx", "4096")),
+            std::stoi(get("--threads", "0")),
+            std::stoi(get("--gpu-layers", "-1")),
+            get("--cache-type-k", "f16"),
+            get("--cache-type-v", "f16"),
+            get("--flash-attn", "auto"),
+            !opt.count("--no-mmap"),
+            opt.count("--mlock") > 0,
+            opt.count("--no-kv-offload") > 0,
+            std::stoi(get("--ram-budget-mb", "0")),
+            /*async_load=*/true,
+            opt.count("--warmup") > 0,
+            loras);
+    } catch (const std::exception & e) {
+        std::fprintf(stderr, "polaris_server: %s\n", e.what());
+        return 1;
+    }
+
+    // Load em background que falhou: sem isso o servidor seguiria aceitando
+    // conexoes e respondendo 'E' pra sempre. Sai com codigo != 0 pra o
+    // supervisor reiniciar.
+    std::atomic<bool> load_failed{ false };
+    std::thread watcher([&] {
+        try {
+            eng->wait(-1.0);
+        } catch (const std::exception & e) {
+            LOG_ERR("server: load do modelo falhou: %s\n", e.what());
+            load_failed = true;
+            g_stop      = true;
+        }
+    });
+
+    JobQueue    queue;
+    std::thread gen([&] {
+        Job job;
+        while (queue.pop(job)) {
+            serve_job(*eng, job);
+            job = Job{};   // solta a conexao (fecha se ja saiu do event loop)
+        }
+    });
+
+    // ---- event loop: accept + leitura ----
+    const int ep = ::epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev{};
+    ev.events  = EPOLLIN;
+    ev.data.fd = lfd;
+    ::epoll_ctl(ep, EPOLL_CTL_ADD, lfd, &ev);
+
+    // Sai do event loop. dead = cancela: os pedidos dela ainda na fila sao
+    // pulados e o que esta gerando para no proximo chunk.
+    std::map<int, ConnPtr> conns;
+    auto drop = [&](int fd) {
+        auto it = conns.find(fd);
+        if (it == conns.end()) return;
+        it->second->dead = true;
+        ::epoll_ctl(ep, EPOLL_CTL_DEL, fd, nullptr);
+        conns.erase(it);
+    };
+
+    LOG_INF("server: escutando em %s\n",
+            opt.count("--unix") ? get("--unix", "").c_str()
+                                : (get("--host", "127.0.0.1") + ":" + get("--port", "8765")).c_str());
+
+    struct epoll_event events[64];
+    char rbuf[64 * 1024];
+    while (!g_stop) {
+        const int n = ::epoll_wait(ep, events, 64, 500);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        for (int k = 0; k < n; ++k) {
+            const int fd = events[k].data.fd;
+            if (fd == lfd) {
+                int cfd;
+                while ((cfd = ::accept4(lfd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+                    int one = 1;
+                    ::setsockopt(cfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));  // falha quieto em unix
+                    ::setsockopt(cfd, SOL_SOCKET, SO_SNDBUF, &SEND_BUF_BYTES, sizeof(SEND_BUF_BYTES));
+                    struct epoll_event cev{};
+                    cev.events  = EPOLLIN | EPOLLRDHUP;
+                    cev.data.fd = cfd;
+                    ::epoll_ctl(ep, EPOLL_CTL_ADD, cfd, &cev);
+                    conns.emplace(cfd, std::make_shared<Conn>(cfd));
+                }
+                continue;
+            }
+
+            auto it = conns.find(fd);
+            if (it == conns.end()) continue;
+            ConnPtr c = it->second;
+
+            // EOF (read()==0 / EPOLLRDHUP) conta como cliente que foi embora:
+            // o protocolo pede o lado de escrita aberto ate o 'D'. Assim um
+            // pedido enfileirado de quem ja fechou nao paga prefill nem decode.
+            bool dead = (events[k].events & (EPOLLERR | EPOLLHUP)) != 0;
+            bool eof  = false;
+            while (!dead && !eof) {
+                const ssize_t r = ::read(fd, rbuf, sizeof(rbuf));
+                if (r > 0) { c->inbuf.append(rbuf, (size_t) r); continue; }
+                if (r == 0) { eof = true; break; }
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                dead = true;
+            }
+            if (!dead && !drain_frames(c, queue)) {
+                LOG_WRN("server: frame invalido, fechando conexao\n");
+                dead = true;
+            }
+            if (dead || eof) drop(fd);
+        }
+    }
+
+    LOG_INF("server: encerrando\n");
+    g_stop = true;
+    queue.cancel_all();
+    queue.cv.notify_all();
+    gen.join();
+    watcher.join();
+    conns.clear();
+    ::close(ep);
+    ::close(lfd);
+    if (opt.count("--unix")) ::unlink(get("--unix", "").c_str());
+    return load_failed ? 1 : 0;
+}